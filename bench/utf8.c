@@ -0,0 +1,123 @@
+// bench/utf8.c display column conversions, decoding every code point
+// against the ASCII fast path in src/utf8.c
+//
+//   gcc -O2 bench/utf8.c src/utf8.c -o utf8_bench && ./utf8_bench
+
+#include "../src/tv.h"
+#include <time.h>
+
+#define LINE 4096      // Bytes per line, about a long log line
+#define ROUNDS 20000
+
+// The decoders as they were, one code point per step
+size_t display_length_decode(const char *data, size_t len) {
+    size_t disp_len = 0;
+    for (size_t i = 0; i < len;) {
+        size_t bytes;
+        uint32_t cp = utf8_to_codepoint(data, i, len, &bytes);
+        disp_len += utf8_char_width(cp);
+        i += bytes;
+    }
+    return disp_len;
+}
+
+size_t byte_to_display_decode(const char *data, size_t byte_pos, size_t len) {
+    size_t disp_pos = 0;
+    for (size_t i = 0; i < byte_pos && i < len;) {
+        size_t bytes;
+        uint32_t cp = utf8_to_codepoint(data, i, len, &bytes);
+        disp_pos += utf8_char_width(cp);
+        i += bytes;
+    }
+    return disp_pos;
+}
+
+size_t display_to_byte_decode(const char *data, size_t disp_pos, size_t len) {
+    size_t byte_pos = 0, curr_disp = 0;
+    for (; byte_pos < len && curr_disp < disp_pos;) {
+        size_t bytes;
+        uint32_t cp = utf8_to_codepoint(data, byte_pos, len, &bytes);
+        curr_disp += utf8_char_width(cp);
+        if (curr_disp <= disp_pos) byte_pos += bytes;
+    }
+    return byte_pos;
+}
+
+// Fill a line from a set of words, cut at a character boundary
+size_t make_line(char *out, const char **words, int count) {
+    size_t len = 0;
+    unsigned r = 7;
+    while (1) {
+        r = r * 1103515245 + 12345;
+        const char *w = words[(r >> 16) % count];
+        size_t n = strlen(w);
+        if (len + n + 1 > LINE) break;
+        memcpy(out + len, w, n);
+        len += n;
+        out[len++] = ' ';
+    }
+    return len;
+}
+
+double now() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+volatile size_t sink;
+
+void bench(const char *name, const char *line, size_t len) {
+    size_t disp = display_length_decode(line, len);
+    for (size_t pos = 0; pos <= len; pos += 37) {
+        if (byte_to_display(line, pos, len) != byte_to_display_decode(line, pos, len) ||
+            display_to_byte(line, pos, len) != display_to_byte_decode(line, pos, len)) {
+            printf("%s: mismatch at %zu\n", name, pos);
+            exit(1);
+        }
+    }
+    if (utf8_display_length(line, len) != disp) {
+        printf("%s: length mismatch\n", name);
+        exit(1);
+    }
+
+    double t[2][3];
+    for (int fast = 0; fast < 2; fast++) {
+        double start = now();
+        for (int i = 0; i < ROUNDS; i++) {
+            sink = fast ? utf8_display_length(line, len) : display_length_decode(line, len);
+        }
+        t[fast][0] = now() - start;
+        start = now();
+        for (int i = 0; i < ROUNDS; i++) {
+            sink = fast ? byte_to_display(line, len - i % 64, len)
+                        : byte_to_display_decode(line, len - i % 64, len);
+        }
+        t[fast][1] = now() - start;
+        start = now();
+        for (int i = 0; i < ROUNDS; i++) {
+            sink = fast ? display_to_byte(line, disp - i % 64, len)
+                        : display_to_byte_decode(line, disp - i % 64, len);
+        }
+        t[fast][2] = now() - start;
+    }
+    const char *what[] = {"display_length", "byte_to_display", "display_to_byte"};
+    for (int k = 0; k < 3; k++) {
+        double before = len * (double)ROUNDS / t[0][k] / 1e9, after = len * (double)ROUNDS / t[1][k] / 1e9;
+        printf("%-9s %-16s %7.2f GB/s -> %7.2f GB/s  x%.1f\n", name, what[k], before, after, after / before);
+    }
+}
+
+int main() {
+    static char line[LINE];
+    const char *ascii[] = {"GET", "/index.html", "HTTP/1.1", "200", "user-agent:", "Mozilla/5.0", "0.003s"};
+    const char *cyrillic[] = {"рядок", "файл", "відкрито", "error", "у", "2024-01-01", "Київ", "OK"};
+    const char *cjk[] = {"漢字", "テスト", "ファイル", "行", "中文", "編集", "表示"};
+    size_t len = make_line(line, ascii, 7);
+    bench("ascii", line, len);
+    len = make_line(line, cyrillic, 8);
+    bench("cyrillic", line, len);
+    len = make_line(line, cjk, 7);
+    bench("cjk", line, len);
+    return 0;
+}
@@ -0,0 +1,149 @@
+// arena.c storage for the pieces of the text and the lines that have been
+// edited: blocks of a few size classes carved out of large chunks, with a
+// free list per class, so an edited file costs a few big allocations and
+// lets go of them all at once
+
+#include "tv.h"
+
+#define ARENA_CHUNK (1 << 20)
+#define ARENA_CLASSES 32
+#define ARENA_LARGE 4096  // Bigger blocks come from malloc() one by one
+
+// Every 16 bytes up to 256, then four classes to each power of two
+static const uint16_t class_size[ARENA_CLASSES] = {
+    16, 32, 48, 64, 80, 96, 112, 128, 144, 160, 176, 192, 208, 224, 240, 256,
+    320, 384, 448, 512, 640, 768, 896, 1024, 1280, 1536, 1792, 2048, 2560, 3072, 3584, 4096};
+
+typedef struct Chunk {
+    struct Chunk *next;
+    size_t unused;  // Keeps the blocks after it 16 byte aligned
+} Chunk;
+
+// Large blocks carry this header, so they can be freed with the rest
+typedef struct Large {
+    struct Large *prev, *next;
+    size_t size, unused;
+} Large;
+
+typedef struct {
+    void *free[ARENA_CLASSES];  // Given back blocks, linked through their first bytes
+    Chunk *chunks;
+    char *next, *end;           // What is left of the newest chunk
+    Large *large;
+    size_t blocks;              // Blocks handed out
+    size_t used;                // Their bytes, by class
+    size_t reserved;            // Bytes taken from malloc()
+} Arena;
+
+static Arena arena;
+
+static int class_of(size_t size) {
+    if (size <= 256) return size ? (size - 1) / 16 : 0;
+    int c = 16;
+    while (class_size[c] < size) c++;
+    return c;
+}
+
+// A block of at least size bytes, *capacity tells how many it has: always
+// a multiple of 16
+void *arena_alloc(size_t size, size_t *capacity) {
+    Arena *a = &arena;
+    a->blocks++;
+    if (size > ARENA_LARGE) {
+        size = (size + 15) & ~(size_t)15;
+        Large *l = malloc(sizeof(Large) + size);
+        l->prev = NULL;
+        l->next = a->large;
+        l->size = size;
+        if (a->large) a->large->prev = l;
+        a->large = l;
+        a->used += size;
+        a->reserved += sizeof(Large) + size;
+        *capacity = size;
+        return l + 1;
+    }
+    int c = class_of(size);
+    a->used += class_size[c];
+    *capacity = class_size[c];
+    void *p = a->free[c];
+    if (p) {
+        a->free[c] = *(void **)p;
+        return p;
+    }
+    if (a->end - a->next < class_size[c]) {
+        Chunk *chunk = malloc(ARENA_CHUNK);
+        chunk->next = a->chunks;
+        a->chunks = chunk;
+        a->next = (char *)(chunk + 1);
+        a->end = (char *)chunk + ARENA_CHUNK;
+        a->reserved += ARENA_CHUNK;
+    }
+    p = a->next;
+    a->next += class_size[c];
+    return p;
+}
+
+// Give back a block, with the size it was asked for or its capacity
+void arena_release(void *p, size_t size) {
+    Arena *a = &arena;
+    if (!p) return;
+    a->blocks--;
+    if (size > ARENA_LARGE) {
+        Large *l = (Large *)p - 1;
+        if (l->prev) l->prev->next = l->next;
+        else a->large = l->next;
+        if (l->next) l->next->prev = l->prev;
+        a->used -= l->size;
+        a->reserved -= sizeof(Large) + l->size;
+        free(l);
+        return;
+    }
+    int c = class_of(size);
+    a->used -= class_size[c];
+    *(void **)p = a->free[c];
+    a->free[c] = p;
+}
+
+// Move a block of `capacity` bytes to one of at least size bytes, keeping
+// what fits of its contents
+void *arena_resize(void *p, size_t capacity, size_t size, size_t *new_capacity) {
+    Arena *a = &arena;
+    if (capacity > ARENA_LARGE && size > ARENA_LARGE) {
+        size = (size + 15) & ~(size_t)15;
+        Large *l = realloc((Large *)p - 1, sizeof(Large) + size);
+        if (l->prev) l->prev->next = l;
+        else a->large = l;
+        if (l->next) l->next->prev = l;
+        a->used += size - l->size;
+        a->reserved += size - l->size;
+        l->size = size;
+        *new_capacity = size;
+        return l + 1;
+    }
+    void *q = arena_alloc(size, new_capacity);
+    memcpy(q, p, capacity < *new_capacity ? capacity : *new_capacity);
+    arena_release(p, capacity);
+    return q;
+}
+
+void arena_stats(size_t *blocks, size_t *used, size_t *reserved) {
+    *blocks = arena.blocks;
+    *used = arena.used;
+    *reserved = arena.reserved;
+}
+
+// Everything handed out goes at once
+void arena_free() {
+    Arena *a = &arena;
+    while (a->chunks) {
+        Chunk *next = a->chunks->next;
+        free(a->chunks);
+        a->chunks = next;
+    }
+    while (a->large) {
+        Large *next = a->large->next;
+        free(a->large);
+        a->large = next;
+    }
+    memset(a, 0, sizeof(*a));
+}
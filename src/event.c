@@ -0,0 +1,74 @@
+// event.c the one place the editor sleeps: a poll() on the terminal, the
+// descriptors of what it reads in the background, and a pipe that both
+// the SIGWINCH handler and the worker threads write to, so a resize or a
+// finished search is seen at once instead of on the next key
+
+#include "tv.h"
+#include <stdatomic.h>
+
+static int wake[2] = {-1, -1};
+static atomic_int posted;              // A thread has written since the last wait
+static volatile sig_atomic_t resized;  // SIGWINCH came since the last wait
+
+static void event_signal(int sig) {
+    int saved = errno;
+    resized = 1;
+    if (write(wake[1], "", 1) < 0) {
+        // A full pipe wakes the editor up already
+    }
+    errno = saved;
+}
+
+// The pipe, and SIGWINCH routed to it
+void event_init() {
+    if (wake[0] == -1 && pipe(wake) == 0) {
+        for (int i = 0; i < 2; i++) {
+            fcntl(wake[i], F_SETFL, O_NONBLOCK);
+            fcntl(wake[i], F_SETFD, FD_CLOEXEC);
+        }
+    }
+    struct sigaction sa;
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = event_signal;
+    sigemptyset(&sa.sa_mask);
+    sa.sa_flags = SA_RESTART;
+    sigaction(SIGWINCH, &sa, NULL);
+}
+
+// Wake the editor up from any thread: something it waits for is done.
+// Posts that come before it looks are folded into one.
+void event_post() {
+    if (wake[1] != -1 && !atomic_exchange(&posted, 1)) {
+        if (write(wake[1], "", 1) < 0) {
+            // As above
+        }
+    }
+}
+
+// Wait up to ms milliseconds (-1 for ever) for input, a resize, a post or
+// one of fds[0..count) to turn readable; descriptors of -1 are skipped.
+// Returns the EVENT_ bits of what happened, 0 when the time ran out.
+int event_wait(int ms, const int *fds, int count) {
+    struct pollfd p[8] = {{STDIN_FILENO, POLLIN, 0}, {wake[0], POLLIN, 0}};
+    int n = 2;
+    for (int i = 0; i < count && n < 8; i++) p[n++] = (struct pollfd){fds[i], POLLIN, 0};
+    int events = 0;
+    if (poll(p, n, ms) > 0) {
+        if (p[0].revents) events |= EVENT_KEY;
+        if (p[1].revents & POLLIN) {
+            char drain[64];
+            while (read(wake[0], drain, sizeof(drain)) > 0) {}
+        }
+        for (int i = 2; i < n; i++) {
+            if (p[i].revents) events |= EVENT_FD;
+        }
+    }
+    // Looked at after the drain, so a post or a signal that comes in
+    // between leaves a byte in the pipe for the next wait
+    if (atomic_exchange(&posted, 0)) events |= EVENT_WORK;
+    if (resized) {
+        resized = 0;
+        events |= EVENT_RESIZE;
+    }
+    return events;
+}
@@ -0,0 +1,789 @@
+// gzip.c gzip files: a DEFLATE decoder that writes the text where the
+// editor reads it, and a checkpoint index saved for the next time. The
+// first open decompresses from the start and records the points; a file
+// opened again is decompressed from the points it has, so that seek.c can
+// fill in whichever stretch is read first, going to a line or to the end
+// only decompresses from the point before it, and the rest is filled in
+// in parallel. zstd and xz go through their own tools as a stream and
+// have no points.
+
+#include "tv.h"
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stddef.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define GZIP_X86 1
+#endif
+
+#define GZIP_SPAN (4 << 20)       // Text between checkpoints
+#define GZIP_WINDOW 32768         // Back references reach this far
+#define GZIP_CACHE_MAGIC "TVGZIP02"
+#define GZIP_SAMPLE (64 << 10)    // Compressed bytes hashed at each end
+#define FAST_BITS 10
+#define DEFLATE_LITS 286          // Literal/length codes a dynamic block may have
+#define DEFLATE_DISTS 30          // Distance codes
+#define DEFLATE_CODES 19          // Code length codes
+#define CRC_POLY 0xedb88320u
+
+// Huffman codes are decoded through a table indexed by the next FAST_BITS
+// bits of input, longer codes by comparing against the last code of every
+// length in turn
+typedef struct {
+    uint16_t fast[1 << FAST_BITS];  // symbol << 4 | length, 0 for longer codes
+    uint16_t first_code[16];
+    uint16_t first_symbol[16];
+    uint32_t max_code[17];          // Past the last code of each length, in 16 bits
+    uint8_t size[288];
+    uint16_t value[288];
+} Huffman;
+
+typedef struct {
+    const uint8_t *in;
+    size_t in_len;
+    size_t pos;             // Next byte of in to load
+    uint64_t bits;          // Loaded bits, the next one lowest
+    int nbits;
+    char *out;              // The whole text, written at out + len
+    size_t len, room;       // Bytes written and bytes there is room for,
+    int grow;               // or more on asking gzip.grow when 1, or by
+                            // reallocating out when 2
+    size_t member;          // Where the member started, -1 if before base
+    size_t base;            // Where this decoder's own output starts,
+    const uint8_t *window;  // with the text before it, for back references
+    size_t window_len;
+    uint32_t crc;           // Of the text from crc_from to crc_at
+    size_t crc_from, crc_at;
+    struct GzipCheck *check;  // For the member that started before base
+    size_t error_at;        // Compressed byte bad data was found at
+} Inflater;
+
+// What one stretch decoded in parallel knows of the CRCs of the members
+// it only saw part of, put together in order once all are done
+typedef struct GzipCheck {
+    uint32_t head_crc;  // Text up to the first member end in the stretch,
+    uint64_t head_len;  // or all of it when none ends there
+    int ended;
+    uint32_t want_crc;  // Trailer of that member
+    uint32_t want_size;
+    size_t want_at;
+    uint32_t tail_crc;  // Text of the member left open at the end
+    uint64_t tail_len;
+} GzipCheck;
+
+// A point to start decoding at: a block boundary, with the window of text
+// before it
+typedef struct {
+    uint64_t in;        // Bit offset of the block in the compressed data
+    uint64_t out;       // Offset of its text
+    uint32_t window_len;
+    uint8_t *window;
+} GzipPoint;
+
+typedef struct {
+    char magic[8];
+    uint64_t in_size;     // Compressed file the points are for
+    int64_t mtime_sec;
+    int64_t mtime_nsec;
+    uint64_t fingerprint; // Of its first and last GZIP_SAMPLE bytes
+    uint64_t out_size;    // Text in the whole file
+    uint64_t points;
+} GzipCacheHeader;
+
+// A point in the cache file, followed by window_len bytes of its window
+typedef struct {
+    uint64_t in;
+    uint64_t out;
+    uint64_t window_len;
+} GzipCachePoint;
+
+typedef struct {
+    const uint8_t *in;
+    size_t in_len;
+    char *out;
+    int (*grow)(size_t need);
+    GzipPoint *points;
+    size_t count, capacity;
+    GzipCheck *checks;       // One for each stretch between points
+    size_t total;            // Text in the whole file, when the points are known
+    atomic_size_t size;      // Text decompressed so far, from the start
+    atomic_int state;        // 0 running, 1 done, -1 bad data
+    atomic_int stop;
+    size_t error_at;         // Compressed byte the bad data is at
+    char cache_path[4200];
+    const char *filename;
+    pthread_t thread;
+    int running;
+} Gzip;
+
+static Gzip gzip;
+
+static Huffman fixed_lit, fixed_dist;
+static uint32_t crc_table[8][256];
+static uint32_t crc_x2n[32];  // x^(2^n) mod the polynomial
+static int crc_folding;       // Carry-less multiply is there
+
+static const uint16_t length_base[29] = {
+    3, 4, 5, 6, 7, 8, 9, 10, 11, 13, 15, 17, 19, 23, 27, 31,
+    35, 43, 51, 59, 67, 83, 99, 115, 131, 163, 195, 227, 258};
+static const uint8_t length_extra[29] = {
+    0, 0, 0, 0, 0, 0, 0, 0, 1, 1, 1, 1, 2, 2, 2, 2, 3, 3, 3, 3, 4, 4, 4, 4, 5, 5, 5, 5, 0};
+static const uint16_t dist_base[30] = {
+    1, 2, 3, 4, 5, 7, 9, 13, 17, 25, 33, 49, 65, 97, 129, 193,
+    257, 385, 513, 769, 1025, 1537, 2049, 3073, 4097, 6145, 8193, 12289, 16385, 24577};
+static const uint8_t dist_extra[30] = {
+    0, 0, 0, 0, 1, 1, 2, 2, 3, 3, 4, 4, 5, 5, 6, 6, 7, 7, 8, 8, 9, 9, 10, 10, 11, 11, 12, 12, 13, 13};
+static const uint8_t length_order[DEFLATE_CODES] = {16, 17, 18, 0, 8, 7, 9, 6, 10, 5, 11, 4, 12, 3, 13, 2, 14, 1, 15};
+
+static void crc_init() {
+    for (uint32_t i = 0; i < 256; i++) {
+        uint32_t c = i;
+        for (int k = 0; k < 8; k++) c = c & 1 ? c >> 1 ^ CRC_POLY : c >> 1;
+        crc_table[0][i] = c;
+    }
+    for (int i = 0; i < 256; i++) {
+        for (int k = 1; k < 8; k++) crc_table[k][i] = crc_table[k - 1][i] >> 8 ^ crc_table[0][crc_table[k - 1][i] & 0xff];
+    }
+#ifdef GZIP_X86
+    __builtin_cpu_init();
+    crc_folding = __builtin_cpu_supports("pclmul") && __builtin_cpu_supports("sse4.1");
+#endif
+}
+
+#ifdef GZIP_X86
+// Fold 64 bytes at a time with carry-less multiplies, then reduce the last
+// 128 bits to the CRC. crc is the inverted running value, len a multiple of
+// 16 and at least 64.
+__attribute__((target("pclmul,sse4.1")))
+static uint32_t crc_fold(uint32_t crc, const uint8_t *p, size_t len) {
+    const __m128i k1k2 = _mm_set_epi64x(0x01c6e41596, 0x0154442bd4);
+    const __m128i k3k4 = _mm_set_epi64x(0x00ccaa009e, 0x01751997d0);
+    const __m128i k5 = _mm_set_epi64x(0, 0x0163cd6124);
+    const __m128i poly = _mm_set_epi64x(0x01f7011641, 0x01db710641);
+    const __m128i low32 = _mm_setr_epi32(~0, 0, ~0, 0);
+    __m128i x1 = _mm_xor_si128(_mm_loadu_si128((const __m128i *)p), _mm_cvtsi32_si128(crc));
+    __m128i x2 = _mm_loadu_si128((const __m128i *)(p + 16));
+    __m128i x3 = _mm_loadu_si128((const __m128i *)(p + 32));
+    __m128i x4 = _mm_loadu_si128((const __m128i *)(p + 48));
+    for (p += 64, len -= 64; len >= 64; p += 64, len -= 64) {
+        x1 = _mm_xor_si128(_mm_xor_si128(_mm_clmulepi64_si128(x1, k1k2, 0x00), _mm_clmulepi64_si128(x1, k1k2, 0x11)),
+                           _mm_loadu_si128((const __m128i *)p));
+        x2 = _mm_xor_si128(_mm_xor_si128(_mm_clmulepi64_si128(x2, k1k2, 0x00), _mm_clmulepi64_si128(x2, k1k2, 0x11)),
+                           _mm_loadu_si128((const __m128i *)(p + 16)));
+        x3 = _mm_xor_si128(_mm_xor_si128(_mm_clmulepi64_si128(x3, k1k2, 0x00), _mm_clmulepi64_si128(x3, k1k2, 0x11)),
+                           _mm_loadu_si128((const __m128i *)(p + 32)));
+        x4 = _mm_xor_si128(_mm_xor_si128(_mm_clmulepi64_si128(x4, k1k2, 0x00), _mm_clmulepi64_si128(x4, k1k2, 0x11)),
+                           _mm_loadu_si128((const __m128i *)(p + 48)));
+    }
+    x1 = _mm_xor_si128(_mm_xor_si128(_mm_clmulepi64_si128(x1, k3k4, 0x00), _mm_clmulepi64_si128(x1, k3k4, 0x11)), x2);
+    x1 = _mm_xor_si128(_mm_xor_si128(_mm_clmulepi64_si128(x1, k3k4, 0x00), _mm_clmulepi64_si128(x1, k3k4, 0x11)), x3);
+    x1 = _mm_xor_si128(_mm_xor_si128(_mm_clmulepi64_si128(x1, k3k4, 0x00), _mm_clmulepi64_si128(x1, k3k4, 0x11)), x4);
+    for (; len >= 16; p += 16, len -= 16) {
+        x1 = _mm_xor_si128(_mm_xor_si128(_mm_clmulepi64_si128(x1, k3k4, 0x00), _mm_clmulepi64_si128(x1, k3k4, 0x11)),
+                           _mm_loadu_si128((const __m128i *)p));
+    }
+    // 128 bits to 64, then 64 to 32 by Barrett reduction
+    x1 = _mm_xor_si128(_mm_srli_si128(x1, 8), _mm_clmulepi64_si128(x1, k3k4, 0x10));
+    x1 = _mm_xor_si128(_mm_srli_si128(x1, 4), _mm_clmulepi64_si128(_mm_and_si128(x1, low32), k5, 0x00));
+    x2 = _mm_and_si128(_mm_clmulepi64_si128(_mm_and_si128(x1, low32), poly, 0x10), low32);
+    x1 = _mm_xor_si128(x1, _mm_clmulepi64_si128(x2, poly, 0x00));
+    return _mm_extract_epi32(x1, 1);
+}
+#endif
+
+// The CRC-32 of gzip trailers, eight bytes at a time, or by folding where
+// the processor can
+static uint32_t crc_update(uint32_t crc, const uint8_t *p, size_t len) {
+    crc = ~crc;
+#ifdef GZIP_X86
+    if (crc_folding && len >= 64) {
+        crc = crc_fold(crc, p, len & ~(size_t)15);
+        p += len & ~(size_t)15;
+        len &= 15;
+    }
+#endif
+    for (; len >= 8; p += 8, len -= 8) {
+        uint32_t lo = crc ^ (p[0] | p[1] << 8 | p[2] << 16 | (uint32_t)p[3] << 24);
+        uint32_t hi = p[4] | p[5] << 8 | p[6] << 16 | (uint32_t)p[7] << 24;
+        crc = crc_table[7][lo & 0xff] ^ crc_table[6][lo >> 8 & 0xff] ^
+              crc_table[5][lo >> 16 & 0xff] ^ crc_table[4][lo >> 24] ^
+              crc_table[3][hi & 0xff] ^ crc_table[2][hi >> 8 & 0xff] ^
+              crc_table[1][hi >> 16 & 0xff] ^ crc_table[0][hi >> 24];
+    }
+    while (len--) crc = crc >> 8 ^ crc_table[0][(crc ^ *p++) & 0xff];
+    return ~crc;
+}
+
+// a * b modulo the polynomial, bit reflected
+static uint32_t crc_multiply(uint32_t a, uint32_t b) {
+    uint32_t m = 1u << 31, p = 0;
+    for (;;) {
+        if (a & m) {
+            p ^= b;
+            if ((a & (m - 1)) == 0) break;
+        }
+        m >>= 1;
+        b = b & 1 ? b >> 1 ^ CRC_POLY : b >> 1;
+    }
+    return p;
+}
+
+// The CRC of text a then text b, from their own CRCs and b's length
+static uint32_t crc_combine(uint32_t a, uint32_t b, uint64_t len_b) {
+    uint32_t p = 1u << 31;  // x^0
+    for (int k = 3; len_b; len_b >>= 1, k++) {
+        if (len_b & 1) p = crc_multiply(crc_x2n[k & 31], p);
+    }
+    return crc_multiply(p, a) ^ b;
+}
+
+static int reverse_bits(int v, int bits) {
+    int r = 0;
+    for (int i = 0; i < bits; i++, v >>= 1) r = r << 1 | (v & 1);
+    return r;
+}
+
+static int huffman_build(Huffman *h, const uint8_t *lengths, int n) {
+    int count[16] = {0}, next_code[16];
+    memset(h->fast, 0, sizeof(h->fast));
+    for (int i = 0; i < n; i++) count[lengths[i]]++;
+    count[0] = 0;
+    int code = 0, k = 0;
+    for (int i = 1; i < 16; i++) {
+        next_code[i] = code;
+        h->first_code[i] = code;
+        h->first_symbol[i] = k;
+        code += count[i];
+        if (code > (1 << i)) return -1;  // More codes than there is room for
+        h->max_code[i] = code << (16 - i);
+        code <<= 1;
+        k += count[i];
+    }
+    h->max_code[16] = 0x10000;
+    for (int i = 0; i < n; i++) {
+        int s = lengths[i];
+        if (!s) continue;
+        int c = next_code[s] - h->first_code[s] + h->first_symbol[s];
+        h->size[c] = s;
+        h->value[c] = i;
+        if (s <= FAST_BITS) {
+            for (int j = reverse_bits(next_code[s], s); j < (1 << FAST_BITS); j += 1 << s) {
+                h->fast[j] = i << 4 | s;
+            }
+        }
+        next_code[s]++;
+    }
+    return 0;
+}
+
+// Keep at least 57 bits loaded. Past the end of the input zeros are
+// loaded, the caller finds out from the bit position.
+static inline void refill(Inflater *z) {
+    while (z->nbits <= 56) {
+        uint64_t byte = z->pos < z->in_len ? z->in[z->pos] : 0;
+        z->pos++;
+        z->bits |= byte << z->nbits;
+        z->nbits += 8;
+    }
+}
+
+static inline int get_bits(Inflater *z, int n) {
+    if (z->nbits < n) refill(z);
+    int v = z->bits & ((1u << n) - 1);
+    z->bits >>= n;
+    z->nbits -= n;
+    return v;
+}
+
+static inline uint64_t bit_pos(Inflater *z) {
+    return (uint64_t)z->pos * 8 - z->nbits;
+}
+
+static void seek_bits(Inflater *z, uint64_t at) {
+    z->pos = at / 8;
+    z->bits = 0;
+    z->nbits = 0;
+    get_bits(z, at % 8);
+}
+
+static inline int decode(Inflater *z, Huffman *h) {
+    if (z->nbits < 16) refill(z);
+    int e = h->fast[z->bits & ((1 << FAST_BITS) - 1)];
+    if (e) {
+        z->bits >>= e & 15;
+        z->nbits -= e & 15;
+        return e >> 4;
+    }
+    int k = reverse_bits(z->bits & 0xffff, 16), s;
+    for (s = FAST_BITS + 1; s < 16 && (uint32_t)k >= h->max_code[s]; s++) {}
+    if (s == 16) return -1;
+    int c = (k >> (16 - s)) - h->first_code[s] + h->first_symbol[s];
+    if (c >= 288 || h->size[c] != s) return -1;
+    z->bits >>= s;
+    z->nbits -= s;
+    return h->value[c];
+}
+
+static int inflate_room(Inflater *z, size_t need) {
+    if (z->room - z->len >= need) return 0;
+    if (z->grow == 2) {
+        char *out = realloc(z->out, (z->len + need) * 2);
+        if (!out) return -1;
+        z->out = out;
+        z->room = (z->len + need) * 2;
+        return 0;
+    }
+    if (!z->grow || gzip.grow(z->len + need + GZIP_SPAN) != 0) return -1;
+    z->room = z->len + need + GZIP_SPAN;
+    return 0;
+}
+
+// Copy a back reference, from the window when it reaches before base
+static int inflate_copy(Inflater *z, size_t dist, size_t length) {
+    char *out = z->out + z->len;
+    if (dist > z->len - z->base) {
+        if (dist > z->len - z->base + z->window_len) return -1;
+        for (size_t i = 0; i < length; i++) {
+            // Compared without going below 0, base is 0 in a buffer of its own
+            size_t ahead = z->len + i;
+            out[i] = ahead < z->base + dist ? z->window[z->window_len - (z->base + dist - ahead)] : z->out[ahead - dist];
+        }
+    } else if (dist >= 8 && z->room - z->len >= length + 8) {
+        for (size_t i = 0; i < length; i += 8) memcpy(out + i, out + i - dist, 8);
+    } else {
+        for (size_t i = 0; i < length; i++) out[i] = out[i - dist];
+    }
+    z->len += length;
+    return 0;
+}
+
+static int inflate_codes(Inflater *z, Huffman *lit, Huffman *dist) {
+    while (z->pos <= z->in_len + 8) {
+        int sym = decode(z, lit);
+        if (sym < 256) {
+            if (sym < 0 || (z->len == z->room && inflate_room(z, 1) != 0)) return -1;
+            z->out[z->len++] = sym;
+            continue;
+        }
+        if (sym == 256) return 0;
+        sym -= 257;
+        if (sym >= 29) return -1;
+        size_t length = length_base[sym] + get_bits(z, length_extra[sym]);
+        int d = decode(z, dist);
+        if (d < 0 || d >= 30) return -1;
+        size_t back = dist_base[d] + get_bits(z, dist_extra[d]);
+        if (inflate_room(z, length) != 0 || inflate_copy(z, back, length) != 0) return -1;
+    }
+    return -1;  // Ran past the end of the input
+}
+
+static int inflate_dynamic(Inflater *z) {
+    Huffman lit, dist, codes;
+    uint8_t lengths[DEFLATE_LITS + DEFLATE_DISTS], code_lengths[DEFLATE_CODES] = {0};
+    int hlit = get_bits(z, 5) + 257, hdist = get_bits(z, 5) + 1, hclen = get_bits(z, 4) + 4;
+    if (hlit > DEFLATE_LITS || hdist > DEFLATE_DISTS) return -1;
+    for (int i = 0; i < hclen; i++) code_lengths[length_order[i]] = get_bits(z, 3);
+    if (huffman_build(&codes, code_lengths, DEFLATE_CODES) != 0) return -1;
+    for (int n = 0; n < hlit + hdist;) {
+        int c = decode(z, &codes), repeat, value = 0;
+        if (c < 0) return -1;
+        if (c < 16) {
+            lengths[n++] = c;
+            continue;
+        }
+        if (c == 16) {
+            if (n == 0) return -1;
+            value = lengths[n - 1];
+            repeat = 3 + get_bits(z, 2);
+        } else if (c == 17) {
+            repeat = 3 + get_bits(z, 3);
+        } else {
+            repeat = 11 + get_bits(z, 7);
+        }
+        if (n + repeat > hlit + hdist) return -1;
+        memset(lengths + n, value, repeat);
+        n += repeat;
+    }
+    if (lengths[256] == 0) return -1;
+    if (huffman_build(&lit, lengths, hlit) != 0 || huffman_build(&dist, lengths + hlit, hdist) != 0) return -1;
+    return inflate_codes(z, &lit, &dist);
+}
+
+static int inflate_stored(Inflater *z) {
+    get_bits(z, z->nbits % 8);
+    size_t at = z->pos - z->nbits / 8;  // Byte the bit buffer starts at
+    if (at + 4 > z->in_len) return -1;
+    size_t len = z->in[at] | z->in[at + 1] << 8;
+    if ((len ^ (z->in[at + 2] | z->in[at + 3] << 8)) != 0xffff || at + 4 + len > z->in_len) return -1;
+    if (inflate_room(z, len) != 0) return -1;
+    memcpy(z->out + z->len, z->in + at + 4, len);
+    z->len += len;
+    seek_bits(z, (uint64_t)(at + 4 + len) * 8);
+    return 0;
+}
+
+// Decode the block at the bit position, returns 1 when it was the last of
+// its member, 0 when more follow and -1 on bad data
+static int inflate_block(Inflater *z) {
+    int last = get_bits(z, 1), type = get_bits(z, 2), result;
+    if (type == 0) result = inflate_stored(z);
+    else if (type == 1) result = inflate_codes(z, &fixed_lit, &fixed_dist);
+    else if (type == 2) result = inflate_dynamic(z);
+    else result = -1;
+    if (result == 0 && bit_pos(z) > (uint64_t)z->in_len * 8) result = -1;  // Ran past the end
+    return result == 0 ? last : -1;
+}
+
+// Skip the gzip header at byte pos, returns where its deflate data starts
+// or 0 when there is no member there
+static size_t gzip_header(const uint8_t *in, size_t len, size_t pos) {
+    if (pos + 10 > len || in[pos] != 0x1f || in[pos + 1] != 0x8b || in[pos + 2] != 8) return 0;
+    int flags = in[pos + 3];
+    pos += 10;
+    if (flags & 4) pos += pos + 2 <= len ? 2 + (in[pos] | in[pos + 1] << 8) : 2;  // Extra field
+    for (int field = 8; field <= 16; field <<= 1) {
+        if (!(flags & field)) continue;  // Name, comment
+        while (pos < len && in[pos]) pos++;
+        pos++;
+    }
+    if (flags & 2) pos += 2;  // Header CRC
+    return pos < len ? pos : 0;
+}
+
+// Header of a gzip file
+int gzip_detect(const char *data, size_t len) {
+    return len >= 3 && (uint8_t)data[0] == 0x1f && (uint8_t)data[1] == 0x8b && data[2] == 8;
+}
+
+static void gzip_point(Inflater *z) {
+    Gzip *g = &gzip;
+    if (g->count == g->capacity) {
+        g->capacity = g->capacity ? g->capacity * 2 : 64;
+        g->points = realloc(g->points, sizeof(GzipPoint) * g->capacity);
+    }
+    GzipPoint *p = &g->points[g->count++];
+    p->in = bit_pos(z);
+    p->out = z->len;
+    p->window_len = z->len - z->base < GZIP_WINDOW ? z->len - z->base : GZIP_WINDOW;
+    p->window = malloc(p->window_len ? p->window_len : 1);
+    memcpy(p->window, z->out + z->len - p->window_len, p->window_len);
+}
+
+// Decode from the state in z until the text reaches `end` at a block
+// boundary or the members run out, going on into the members that follow.
+// Checkpoints are recorded when `record`. Returns 0, or -1 on bad data.
+static int gzip_decode(Inflater *z, size_t end, int record) {
+    Gzip *g = &gzip;
+    size_t last = g->count ? g->points[g->count - 1].out : 0;
+    while (z->len < end && !atomic_load(&g->stop)) {
+        if (record && (g->count == 0 || z->len - last >= GZIP_SPAN)) {
+            gzip_point(z);
+            last = z->len;
+        }
+        int result = inflate_block(z);
+        if (result == -1) {
+            z->error_at = bit_pos(z) / 8 < z->in_len ? bit_pos(z) / 8 : z->in_len;
+            return -1;
+        }
+        if (record) atomic_store(&g->size, z->len);
+        z->crc = crc_update(z->crc, (const uint8_t *)z->out + z->crc_at, z->len - z->crc_at);
+        z->crc_at = z->len;
+        if (result == 0) continue;
+        // The trailer has the member's CRC and size, then maybe another member
+        get_bits(z, z->nbits % 8);
+        size_t at = z->pos - z->nbits / 8 + 8;
+        if (at > z->in_len) {
+            z->error_at = z->in_len;
+            return -1;
+        }
+        const uint8_t *t = z->in + at - 8;
+        uint32_t want_crc = t[0] | t[1] << 8 | t[2] << 16 | (uint32_t)t[3] << 24;
+        uint32_t want_size = t[4] | t[5] << 8 | t[6] << 16 | (uint32_t)t[7] << 24;
+        if (z->member == (size_t)-1 && z->check) {
+            GzipCheck *c = z->check;
+            c->head_crc = z->crc;
+            c->head_len = z->len - z->crc_from;
+            c->ended = 1;
+            c->want_crc = want_crc;
+            c->want_size = want_size;
+            c->want_at = at;
+        } else if (z->member != (size_t)-1 && (z->crc != want_crc || (uint32_t)(z->len - z->member) != want_size)) {
+            z->error_at = at;
+            return -1;
+        }
+        z->crc = 0;
+        z->crc_from = z->len;
+        size_t start = gzip_header(z->in, z->in_len, at);
+        if (!start) break;
+        seek_bits(z, (uint64_t)start * 8);
+        z->member = z->base = z->len;
+        z->window_len = 0;
+    }
+    if (z->check && !z->check->ended) {
+        z->check->head_crc = z->crc;
+        z->check->head_len = z->len - z->crc_from;
+    } else if (z->check) {
+        z->check->tail_crc = z->crc;
+        z->check->tail_len = z->len - z->crc_from;
+    }
+    return 0;
+}
+
+// Decode the text between two checkpoints
+static void gzip_task(size_t task, void *arg) {
+    Gzip *g = &gzip;
+    size_t *first = arg;
+    GzipPoint *p = &g->points[*first + task];
+    size_t end = *first + task + 1 < g->count ? p[1].out : g->total;
+    Inflater z = {.in = g->in, .in_len = g->in_len, .out = g->out, .len = p->out, .room = end,
+                  .member = -1, .base = p->out, .window = p->window, .window_len = p->window_len,
+                  .crc_from = p->out, .crc_at = p->out, .check = &g->checks[*first + task]};
+    seek_bits(&z, p->in);
+    if (gzip_decode(&z, end, 0) != 0 || z.len != end) atomic_store(&g->state, -1);
+}
+
+static uint64_t gzip_fingerprint() {
+    uint64_t h = 14695981039346656037ULL;
+    size_t head = gzip.in_len < GZIP_SAMPLE ? gzip.in_len : GZIP_SAMPLE;
+    for (size_t i = 0; i < head; i++) h = (h ^ gzip.in[i]) * 1099511628211ULL;
+    for (size_t i = gzip.in_len - head; i < gzip.in_len; i++) h = (h ^ gzip.in[i]) * 1099511628211ULL;
+    return h;
+}
+
+static int gzip_cache_header(GzipCacheHeader *h) {
+    struct stat st;
+    if (stat(gzip.filename, &st) != 0) return -1;
+    memset(h, 0, sizeof(*h));
+    memcpy(h->magic, GZIP_CACHE_MAGIC, 8);
+    h->in_size = gzip.in_len;
+    h->mtime_sec = st.st_mtim.tv_sec;
+    h->mtime_nsec = st.st_mtim.tv_nsec;
+    h->fingerprint = gzip_fingerprint();
+    return 0;
+}
+
+// Checkpoints of an earlier run, if the file has not changed since
+static int gzip_load_points() {
+    Gzip *g = &gzip;
+    GzipCacheHeader want, h;
+    if (!g->cache_path[0] || gzip_cache_header(&want) != 0) return -1;
+    FILE *f = fopen(g->cache_path, "rb");
+    if (!f) return -1;
+    int ok = fread(&h, sizeof(h), 1, f) == 1 && memcmp(h.magic, want.magic, 8) == 0 &&
+             h.in_size == want.in_size && h.mtime_sec == want.mtime_sec &&
+             h.mtime_nsec == want.mtime_nsec && h.fingerprint == want.fingerprint && h.points > 0;
+    // The first unit of seek.c starts at 0, the rest go forward within the text
+    for (uint64_t i = 0; ok && i < h.points; i++) {
+        GzipCachePoint c;
+        ok = fread(&c, sizeof(c), 1, f) == 1 && c.window_len <= GZIP_WINDOW && c.in < (uint64_t)g->in_len * 8 &&
+             (i > 0 || c.out == 0) && (i == 0 || c.out > g->points[g->count - 1].out) && c.out <= h.out_size;
+        if (!ok) break;
+        GzipPoint p = {c.in, c.out, (uint32_t)c.window_len, NULL};
+        p.window = malloc(p.window_len ? p.window_len : 1);
+        ok = fread(p.window, 1, p.window_len, f) == p.window_len;
+        if (g->count == g->capacity) {
+            g->capacity = g->capacity ? g->capacity * 2 : 64;
+            g->points = realloc(g->points, sizeof(GzipPoint) * g->capacity);
+        }
+        g->points[g->count++] = p;
+    }
+    fclose(f);
+    if (!ok) return -1;
+    g->total = h.out_size;
+    return 0;
+}
+
+static void gzip_save_points() {
+    Gzip *g = &gzip;
+    GzipCacheHeader h;
+    if (!g->cache_path[0] || gzip_cache_header(&h) != 0) return;
+    h.out_size = atomic_load(&g->size);
+    h.points = g->count;
+    char tmp[sizeof(g->cache_path) + 32];
+    cache_mkdir(g->cache_path);
+    snprintf(tmp, sizeof(tmp), "%s.%d", g->cache_path, (int)getpid());
+    FILE *f = fopen(tmp, "wb");
+    if (!f) return;
+    int ok = fwrite(&h, sizeof(h), 1, f) == 1;
+    for (size_t i = 0; ok && i < g->count; i++) {
+        GzipPoint *p = &g->points[i];
+        GzipCachePoint c = {p->in, p->out, p->window_len};
+        ok = fwrite(&c, sizeof(c), 1, f) == 1 && fwrite(p->window, 1, p->window_len, f) == p->window_len;
+    }
+    if (fclose(f) != 0) ok = 0;
+    if (!ok || rename(tmp, g->cache_path) != 0) unlink(tmp);
+}
+
+static void gzip_free_points() {
+    for (size_t i = 0; i < gzip.count; i++) free(gzip.points[i].window);
+    free(gzip.points);
+    gzip.points = NULL;
+    gzip.count = gzip.capacity = 0;
+}
+
+// Put the CRCs of the members that span stretches together and compare
+// them with their trailers
+static int gzip_check(size_t *error_at) {
+    Gzip *g = &gzip;
+    uint32_t crc = 0;
+    uint64_t len = 0;
+    for (size_t i = 0; i < g->count; i++) {
+        GzipCheck *c = &g->checks[i];
+        crc = crc_combine(crc, c->head_crc, c->head_len);
+        len += c->head_len;
+        if (!c->ended) continue;
+        if (crc != c->want_crc || (uint32_t)len != c->want_size) {
+            *error_at = c->want_at;
+            return -1;
+        }
+        crc = c->tail_crc;
+        len = c->tail_len;
+    }
+    return 0;
+}
+
+// With the checkpoints known the stretches between them are decoded on
+// the pool, a round at a time so the text still arrives from the start
+static int gzip_parallel() {
+    Gzip *g = &gzip;
+    if (g->grow(g->total) != 0) return -1;
+    free(g->checks);
+    g->checks = calloc(g->count, sizeof(GzipCheck));
+    size_t round = pool_threads() * 2;
+    for (size_t first = 0; first < g->count && !atomic_load(&g->stop); first += round) {
+        size_t n = g->count - first < round ? g->count - first : round;
+        pool_run(n, gzip_task, &first);
+        if (atomic_load(&g->state) == -1) return -1;
+        atomic_store(&g->size, first + n < g->count ? g->points[first + n].out : g->total);
+    }
+    return atomic_load(&g->stop) ? 0 : gzip_check(&g->error_at);
+}
+
+// Fill text[from..to) for seek.c: the stretch from the point of the unit,
+// which is at or before from, is decoded into a buffer of its own with
+// what can be checked of its CRCs, then on into the next stretch as far
+// as to
+static int gzip_fill(size_t unit, char *out, size_t from, size_t to, size_t *error_at) {
+    Gzip *g = &gzip;
+    GzipPoint *p = &g->points[unit];
+    size_t end = (unit + 1 < g->count ? p[1].out : g->total) - p->out;
+    Inflater z = {.in = g->in, .in_len = g->in_len, .room = to - p->out + GZIP_WINDOW, .grow = 2,
+                  .member = -1, .window = p->window, .window_len = p->window_len,
+                  .check = &g->checks[unit], .error_at = g->in_len};
+    z.out = malloc(z.room);
+    seek_bits(&z, p->in);
+    int ok = z.out && gzip_decode(&z, end, 0) == 0 && z.len == end;
+    z.check = NULL;
+    if (ok && to - p->out > end) ok = gzip_decode(&z, to - p->out, 0) == 0 && z.len >= to - p->out;
+    if (ok) memcpy(out, z.out + (from - p->out), to - from);
+    else *error_at = z.error_at;
+    free(z.out);
+    return ok ? 0 : -1;
+}
+
+// The whole text read in sequence, or in parallel from known points
+static void *gzip_worker(void *unused) {
+    Gzip *g = &gzip;
+    int state = 1;
+    if (!g->total || gzip_parallel() != 0) {
+        // No points, or points that do not fit the file: start over without them
+        gzip_free_points();
+        atomic_store(&g->size, 0);
+        atomic_store(&g->state, 0);
+        g->total = 0;
+        state = 0;
+    }
+    if (state == 0) {
+        Inflater z = {.in = g->in, .in_len = g->in_len, .out = g->out, .grow = 1};
+        seek_bits(&z, (uint64_t)gzip_header(g->in, g->in_len, 0) * 8);
+        state = gzip_decode(&z, (size_t)-1, 1) == 0 ? 1 : -1;
+        if (state == -1) g->error_at = z.error_at;
+        if (state == 1 && !atomic_load(&g->stop) && g->count > 1) gzip_save_points();
+    }
+    if (!atomic_load(&g->stop)) atomic_store(&g->state, state);
+    event_post();
+    return NULL;
+}
+
+// The gzip file `filename`, in[0..len): returns the size of its text when
+// an earlier run left checkpoints for it, 0 when it has to be read through
+// first
+size_t gzip_index(const char *filename, const char *in, size_t len) {
+    Gzip *g = &gzip;
+    static int fixed;
+    if (!fixed) {
+        uint8_t lengths[288];
+        memset(lengths, 8, 144);
+        memset(lengths + 144, 9, 112);
+        memset(lengths + 256, 7, 24);
+        memset(lengths + 280, 8, 8);
+        huffman_build(&fixed_lit, lengths, 288);
+        memset(lengths, 5, 30);
+        huffman_build(&fixed_dist, lengths, 30);
+        crc_init();
+        crc_x2n[0] = 1u << 30;  // x^1
+        for (int i = 1; i < 32; i++) crc_x2n[i] = crc_multiply(crc_x2n[i - 1], crc_x2n[i - 1]);
+        fixed = 1;
+    }
+    g->in = (const uint8_t *)in;
+    g->in_len = len;
+    g->filename = filename;
+    if (!cache_path(filename, "gzi", g->cache_path, sizeof(g->cache_path))) g->cache_path[0] = 0;
+    if (gzip_load_points() != 0) {
+        gzip_free_points();
+        g->total = 0;
+    }
+    return g->total;
+}
+
+// With the checkpoints known, have seek.c map the text at its full size
+// at text, a unit for every stretch between them, decoded where it is read
+int gzip_seek(char *text) {
+    Gzip *g = &gzip;
+    uint64_t *points = malloc(sizeof(uint64_t) * g->count);
+    if (!points) return -1;
+    for (size_t i = 0; i < g->count; i++) points[i] = g->points[i].out;
+    free(g->checks);
+    g->checks = calloc(g->count, sizeof(GzipCheck));
+    int result = g->checks ? seek_open(text, g->total, points, g->count, gzip_fill, gzip_check) : -1;
+    free(points);
+    return result;
+}
+
+// Decompress the file given to gzip_index() into out on a thread of its
+// own, from the checkpoints if there are any. grow(need) makes room for
+// need bytes of text at out. gzip_size() tells how much of it is there so
+// far.
+void gzip_start(char *out, int (*grow)(size_t need)) {
+    Gzip *g = &gzip;
+    g->out = out;
+    g->grow = grow;
+    atomic_store(&g->size, 0);
+    atomic_store(&g->state, 0);
+    atomic_store(&g->stop, 0);
+    g->running = pthread_create(&g->thread, NULL, gzip_worker, NULL) == 0;
+    if (!g->running) gzip_worker(NULL);
+}
+
+// Bytes of text decompressed so far
+size_t gzip_size() {
+    return atomic_load(&gzip.size);
+}
+
+// 0 while decompressing, 1 when done, -1 on bad data found at *at
+int gzip_state(size_t *at) {
+    *at = gzip.error_at;
+    return atomic_load(&gzip.state);
+}
+
+void gzip_free() {
+    if (gzip.running) {
+        atomic_store(&gzip.stop, 1);
+        pthread_join(gzip.thread, NULL);
+        gzip.running = 0;
+    }
+    gzip_free_points();
+    free(gzip.checks);
+    gzip.checks = NULL;
+}
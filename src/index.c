@@ -0,0 +1,756 @@
+// index.c line index: newline scanner and line start offsets
+
+#include "tv.h"
+#include <pthread.h>
+#include <stdatomic.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define INDEX_X86 1
+#endif
+
+#define INDEX_BLOCK_BITS 14
+#define INDEX_BLOCK (1 << INDEX_BLOCK_BITS)  // Marks per block
+#define INDEX_BLOCKS (1 << 16)               // Up to 1G marks
+#define INDEX_STRIDE 256                     // Lines between marks
+#define INDEX_MARK_BYTES (64 << 10)          // Or bytes between marks
+#define INDEX_SCRATCH 4096                   // Offsets scanned per batch
+#define INDEX_SLICE (8 << 20)                // Bytes per slice of a parallel round
+#define INDEX_CACHE_MIN (16 << 20)           // Smaller files are not worth a cache file
+#define INDEX_SAMPLES 16                     // Blocks hashed into the fingerprint
+#define INDEX_SAMPLE (4 << 10)
+
+// The index is sparse: it keeps the start of every INDEX_STRIDE-th line
+// (and of the first line after every INDEX_MARK_BYTES), anything in
+// between is found by scanning forward from the nearest mark
+typedef struct {
+    uint64_t line;      // Line number
+    uint64_t offset;    // Offset of its first byte
+} IndexMark;
+
+// Marks are stored in fixed blocks that never move, so the UI thread can
+// read everything below the published count while the worker appends
+typedef struct {
+    IndexMark *blocks[INDEX_BLOCKS];
+    atomic_size_t marks;     // Published marks
+    atomic_size_t newlines;  // Newlines in the scanned part
+    atomic_size_t scanned;   // Bytes scanned so far
+    atomic_int done;         // Whole file scanned
+    atomic_int stop;         // Ask the worker to quit
+    const char *data;        // Text being indexed
+    size_t size;
+    size_t cached;           // Bytes covered by the cache file we loaded
+    size_t unverified;       // Of those, the prefix of a grown file not checked yet
+    uint64_t cached_digest;  // What its digest has to be
+    atomic_int stale;        // It did not match: the file has to be read again
+    uint64_t *digests;       // Hashes of the first digested slices
+    size_t digested, digests_room;
+    const char *filename;    // File the cache belongs to
+    int derived;             // The text is decompressed from it
+    char cache_path[4200];
+    pthread_t thread;
+    int running;
+    pthread_mutex_t lock;    // Guards waiting on progress
+    pthread_cond_t cond;
+} LineIndex;
+
+LineIndex line_index = {.lock = PTHREAD_MUTEX_INITIALIZER, .cond = PTHREAD_COND_INITIALIZER};
+
+// Scanners record the offset following every newline in data[0..len) as
+// base + i + 1 into out, stopping once max offsets are stored. They return
+// the number of offsets stored and set *scanned to the bytes consumed.
+
+size_t scan_newlines_scalar(const char *data, size_t len, uint64_t base,
+                            uint64_t *out, size_t max, size_t *scanned) {
+    size_t n = 0;
+    const char *p = data, *end = data + len;
+    while (n < max && p < end) {
+        const char *nl = memchr(p, '\n', end - p);
+        if (!nl) {
+            p = end;
+            break;
+        }
+        out[n++] = base + (nl - data) + 1;
+        p = nl + 1;
+    }
+    *scanned = p - data;
+    return n;
+}
+
+#ifdef INDEX_X86
+size_t scan_newlines_sse2(const char *data, size_t len, uint64_t base,
+                          uint64_t *out, size_t max, size_t *scanned) {
+    const __m128i nl = _mm_set1_epi8('\n');
+    size_t n = 0, i = 0;
+    for (; i + 16 <= len; i += 16) {
+        __m128i v = _mm_loadu_si128((const __m128i *)(data + i));
+        unsigned mask = _mm_movemask_epi8(_mm_cmpeq_epi8(v, nl));
+        while (mask) {
+            size_t at = i + __builtin_ctz(mask);
+            out[n++] = base + at + 1;
+            mask &= mask - 1;
+            if (n == max) {
+                *scanned = at + 1;
+                return n;
+            }
+        }
+    }
+    size_t tail;
+    n += scan_newlines_scalar(data + i, len - i, base + i, out + n, max - n, &tail);
+    *scanned = i + tail;
+    return n;
+}
+
+__attribute__((target("avx2")))
+size_t scan_newlines_avx2(const char *data, size_t len, uint64_t base,
+                          uint64_t *out, size_t max, size_t *scanned) {
+    const __m256i nl = _mm256_set1_epi8('\n');
+    size_t n = 0, i = 0;
+    for (; i + 64 <= len; i += 64) {
+        __m256i a = _mm256_loadu_si256((const __m256i *)(data + i));
+        __m256i b = _mm256_loadu_si256((const __m256i *)(data + i + 32));
+        uint64_t mask = (uint32_t)_mm256_movemask_epi8(_mm256_cmpeq_epi8(a, nl)) |
+                        (uint64_t)(uint32_t)_mm256_movemask_epi8(_mm256_cmpeq_epi8(b, nl)) << 32;
+        while (mask) {
+            size_t at = i + __builtin_ctzll(mask);
+            out[n++] = base + at + 1;
+            mask &= mask - 1;
+            if (n == max) {
+                *scanned = at + 1;
+                return n;
+            }
+        }
+    }
+    size_t tail;
+    n += scan_newlines_sse2(data + i, len - i, base + i, out + n, max - n, &tail);
+    *scanned = i + tail;
+    return n;
+}
+#endif
+
+size_t (*scan_newlines)(const char *data, size_t len, uint64_t base,
+                        uint64_t *out, size_t max, size_t *scanned) = NULL;
+
+void index_init() {
+    scan_newlines = scan_newlines_scalar;
+#ifdef INDEX_X86
+    __builtin_cpu_init();
+    scan_newlines = __builtin_cpu_supports("avx2") ? scan_newlines_avx2 : scan_newlines_sse2;
+#endif
+}
+
+static inline IndexMark *index_mark(size_t i) {
+    return &line_index.blocks[i >> INDEX_BLOCK_BITS][i & (INDEX_BLOCK - 1)];
+}
+
+// Store mark i, returns 0 when the index is full
+static int index_put(size_t i, uint64_t line, uint64_t offset) {
+    if (i >> INDEX_BLOCK_BITS >= INDEX_BLOCKS) return 0;
+    IndexMark **block = &line_index.blocks[i >> INDEX_BLOCK_BITS];
+    if (!*block) *block = malloc(sizeof(IndexMark) * INDEX_BLOCK);
+    (*block)[i & (INDEX_BLOCK - 1)] = (IndexMark){line, offset};
+    return 1;
+}
+
+// Make everything stored so far visible to readers
+static void index_publish(size_t marks, size_t newlines, size_t scanned) {
+    LineIndex *ix = &line_index;
+    pthread_mutex_lock(&ix->lock);
+    atomic_store(&ix->marks, marks);
+    atomic_store(&ix->newlines, newlines);
+    atomic_store(&ix->scanned, scanned);
+    if (scanned >= ix->size) atomic_store(&ix->done, 1);
+    pthread_cond_broadcast(&ix->cond);
+    pthread_mutex_unlock(&ix->lock);
+    if (scanned >= ix->size) event_post();
+}
+
+// A slice of the file is scanned on its own, numbering lines from its
+// start. Slices are stitched in order with a prefix sum over their newline
+// counts, so several can be scanned at the same time.
+typedef struct {
+    IndexMark *marks;    // Marks with slice-relative line numbers
+    size_t count;
+    size_t capacity;
+    size_t newlines;
+    size_t start, end;   // Byte range of the slice
+    uint64_t *scratch;
+} IndexSlice;
+
+typedef struct {
+    IndexSlice *slices;
+    size_t count;
+} IndexRound;
+
+static void index_scan_slice(size_t task, void *arg) {
+    IndexSlice *sl = &((IndexRound *)arg)->slices[task];
+    if (!sl->scratch) sl->scratch = malloc(sizeof(uint64_t) * INDEX_SCRATCH);
+    uint64_t last_line = 0, last_offset = sl->start;
+    size_t pos = sl->start;
+    sl->count = sl->newlines = 0;
+    seek_need(line_index.data + sl->start, sl->end - sl->start);
+    while (pos < sl->end) {
+        size_t scanned;
+        size_t n = scan_newlines(line_index.data + pos, sl->end - pos, pos,
+                                 sl->scratch, INDEX_SCRATCH, &scanned);
+        for (size_t i = 0; i < n; i++) {
+            uint64_t line = sl->newlines + i + 1, offset = sl->scratch[i];
+            if (line - last_line < INDEX_STRIDE && offset - last_offset < INDEX_MARK_BYTES) continue;
+            if (sl->count == sl->capacity) {
+                sl->capacity = sl->capacity ? sl->capacity * 2 : 1024;
+                sl->marks = realloc(sl->marks, sizeof(IndexMark) * sl->capacity);
+            }
+            sl->marks[sl->count++] = (IndexMark){line, offset};
+            last_line = line;
+            last_offset = offset;
+        }
+        sl->newlines += n;
+        pos += scanned;
+    }
+}
+
+// Append the slices to the index in order and publish them
+static void index_stitch(IndexSlice *slices, size_t n) {
+    LineIndex *ix = &line_index;
+    size_t marks = atomic_load(&ix->marks), newlines = atomic_load(&ix->newlines);
+    size_t scanned = atomic_load(&ix->scanned);
+    for (size_t i = 0; i < n; i++) {
+        IndexSlice *sl = &slices[i];
+        for (size_t j = 0; j < sl->count; j++) {
+            if (!index_put(marks, newlines + sl->marks[j].line, sl->marks[j].offset)) break;
+            marks++;
+        }
+        newlines += sl->newlines;
+        scanned = sl->end;
+    }
+    index_publish(marks, newlines, scanned);
+}
+
+// Scan up to limit bytes on the calling thread
+static void index_step(size_t limit) {
+    static IndexSlice sl;
+    sl.start = atomic_load(&line_index.scanned);
+    sl.end = sl.start + limit < line_index.size ? sl.start + limit : line_index.size;
+    IndexRound round = {&sl, 1};
+    index_scan_slice(0, &round);
+    index_stitch(&sl, 1);
+}
+
+// Scan the next stretch of the file in parallel, one slice per thread
+static void index_round(IndexRound *round) {
+    size_t pos = atomic_load(&line_index.scanned), n = 0;
+    for (; n < round->count && pos < line_index.size; n++) {
+        IndexSlice *sl = &round->slices[n];
+        sl->start = pos;
+        sl->end = pos + INDEX_SLICE < line_index.size ? pos + INDEX_SLICE : line_index.size;
+        pos = sl->end;
+    }
+    IndexRound part = {round->slices, n};
+    pool_run(n, index_scan_slice, &part);
+    index_stitch(round->slices, n);
+}
+
+// Digest of all of data[0..size): every INDEX_SLICE of it hashed a word at
+// a time on the pool, then the slice hashes in order. The hashes of whole
+// slices are kept, and the worker adds them once it has scanned the file,
+// so saving the cache only hashes the last part slice and whatever the
+// worker has not got to.
+typedef struct {
+    const char *data;
+    size_t size;
+    size_t first;        // Slice of task 0
+    uint64_t *hashes;    // Of slices first on
+} IndexDigest;
+
+static void index_digest_slice(size_t task, void *arg) {
+    IndexDigest *d = arg;
+    size_t slice = d->first + task;
+    size_t at = slice * (size_t)INDEX_SLICE;
+    size_t end = d->size - at < INDEX_SLICE ? d->size : at + INDEX_SLICE;
+    uint64_t h = 14695981039346656037ULL ^ slice;
+    for (; at + 8 <= end; at += 8) {
+        uint64_t w;
+        memcpy(&w, d->data + at, 8);
+        h ^= w;
+        h = ((h << 31) | (h >> 33)) * 0x9e3779b97f4a7c15ULL;
+    }
+    for (; at < end; at++) h = (h ^ (unsigned char)d->data[at]) * 1099511628211ULL;
+    d->hashes[task] = h;
+}
+
+static int index_digest_wanted() {
+    return line_index.cache_path[0] && line_index.size >= INDEX_CACHE_MIN && !line_index.derived;
+}
+
+// Hash up to count of the whole slices below size not hashed yet, returns
+// how many it did
+static size_t index_digest_slices(size_t size, size_t count) {
+    LineIndex *ix = &line_index;
+    size_t first = ix->digested, n = size / INDEX_SLICE;
+    if (n <= first) return 0;
+    if (n - first > count) n = first + count;
+    if (n > ix->digests_room) {
+        size_t room = ix->digests_room ? ix->digests_room * 2 : 64;
+        if (room < n) room = n;
+        uint64_t *digests = realloc(ix->digests, sizeof(uint64_t) * room);
+        if (!digests) return 0;
+        ix->digests = digests;
+        ix->digests_room = room;
+    }
+    IndexDigest d = {ix->data, size, first, ix->digests + first};
+    pool_run(n - first, index_digest_slice, &d);
+    ix->digested = n;
+    return n - first;
+}
+
+static uint64_t index_digest(size_t size) {
+    LineIndex *ix = &line_index;
+    size_t n = size / INDEX_SLICE;
+    uint64_t h = 14695981039346656037ULL ^ size;
+    index_digest_slices(size, (size_t)-1);
+    if (ix->digested < n) return h;  // Out of memory, matches nothing
+    uint64_t tail = 0;
+    if (size % INDEX_SLICE) {
+        IndexDigest d = {ix->data, size, n, &tail};
+        index_digest_slice(0, &d);
+    }
+    for (size_t i = 0; i < n + (size % INDEX_SLICE != 0); i++) {
+        h = (h ^ (i < n ? ix->digests[i] : tail)) * 1099511628211ULL;
+        h ^= h >> 29;
+    }
+    return h;
+}
+
+// The cached marks of a grown file were published before its prefix was
+// hashed. If the prefix is not what was indexed, the cache file goes and
+// index_stale() tells the UI to read the file again.
+static void index_verify() {
+    LineIndex *ix = &line_index;
+    size_t size = ix->unverified;
+    ix->unverified = 0;
+    if (index_digest(size) == ix->cached_digest) return;
+    unlink(ix->cache_path);
+    ix->cache_path[0] = 0;
+    atomic_store(&ix->stale, 1);
+    event_post();
+}
+
+static void *index_worker(void *arg) {
+    IndexRound round;
+    round.count = pool_threads();
+    round.slices = calloc(round.count, sizeof(IndexSlice));
+    // A cached prefix is checked first, then lines, then the digest for the
+    // cache, a round at a time so a stop is seen soon
+    while (!atomic_load(&line_index.stop) && !atomic_load(&line_index.stale)) {
+        if (line_index.unverified) {
+            if (!index_digest_slices(line_index.unverified, round.count)) index_verify();
+        } else if (!atomic_load(&line_index.done)) {
+            index_round(&round);
+        } else if (!index_digest_wanted() || !index_digest_slices(line_index.size, round.count)) {
+            break;
+        }
+    }
+    for (size_t i = 0; i < round.count; i++) {
+        free(round.slices[i].marks);
+        free(round.slices[i].scratch);
+    }
+    free(round.slices);
+    return NULL;
+}
+
+// Fingerprint of data[0..size): FNV-1a over its head, its tail and evenly
+// spread samples in between
+static uint64_t index_fingerprint(const char *data, size_t size) {
+    uint64_t h = 14695981039346656037ULL;
+    for (int i = 0; i <= INDEX_SAMPLES + 1; i++) {
+        size_t at = i == 0 ? 0 : (i == INDEX_SAMPLES + 1 ? size : size / (INDEX_SAMPLES + 1) * i);
+        size_t len = i == 0 || i == INDEX_SAMPLES + 1 ? INDEX_SAMPLE * 16 : INDEX_SAMPLE;
+        if (i == INDEX_SAMPLES + 1) at = size > len ? size - len : 0;
+        if (at + len > size) len = size - at;
+        for (size_t j = 0; j < len; j++) {
+            h = (h ^ (unsigned char)data[at + j]) * 1099511628211ULL;
+        }
+    }
+    return h;
+}
+
+typedef struct {
+    char magic[8];
+    uint64_t size;        // Bytes covered by the index
+    int64_t mtime_sec;    // File time when the cache was written
+    int64_t mtime_nsec;
+    uint64_t file_size;   // File size when the cache was written
+    uint64_t fingerprint; // Of the first size bytes
+    uint64_t digest;      // Of all of them, for a file that has grown
+    uint64_t newlines;
+    uint64_t marks;
+    uint64_t marks_hash;  // Of the marks that follow
+} IndexCacheHeader;
+
+#define INDEX_CACHE_MAGIC "TVINDEX3"
+
+// Cache files live in $XDG_CACHE_HOME/tv (or ~/.cache/tv), named after
+// a hash of the absolute path of the file, with `ext` telling what they hold
+int cache_path(const char *filename, const char *ext, char *out, size_t size) {
+    char real[4096];
+    if (!realpath(filename, real)) return 0;
+    const char *base = getenv("XDG_CACHE_HOME");
+    char dir[4096];
+    if (base && *base) {
+        snprintf(dir, sizeof(dir), "%s", base);
+    } else {
+        const char *home = getenv("HOME");
+        if (!home || !*home) return 0;
+        snprintf(dir, sizeof(dir), "%s/.cache", home);
+    }
+    uint64_t h = 14695981039346656037ULL;
+    for (const char *p = real; *p; p++) h = (h ^ (unsigned char)*p) * 1099511628211ULL;
+    snprintf(out, size, "%s/tv/%016llx.%s", dir, (unsigned long long)h, ext);
+    return 1;
+}
+
+// Create the directories of a cache file
+void cache_mkdir(const char *path) {
+    char dir[4200];
+    snprintf(dir, sizeof(dir), "%s", path);
+    *strrchr(dir, '/') = 0;
+    char *slash = strrchr(dir, '/');
+    *slash = 0;
+    mkdir(dir, 0755);
+    *slash = '/';
+    mkdir(dir, 0755);
+}
+
+static uint64_t index_marks_hash(size_t marks) {
+    uint64_t h = 14695981039346656037ULL;
+    for (size_t i = 0; i < marks; i += INDEX_BLOCK) {
+        size_t n = marks - i < INDEX_BLOCK ? marks - i : INDEX_BLOCK;
+        const unsigned char *p = (const unsigned char *)line_index.blocks[i >> INDEX_BLOCK_BITS];
+        for (size_t j = 0; j < n * sizeof(IndexMark); j++) h = (h ^ p[j]) * 1099511628211ULL;
+    }
+    return h;
+}
+
+// Marks read from a cache start at line 0, run forward and stay within the
+// text they cover, or the cache file is damaged
+static int index_cache_marks(const IndexCacheHeader *h) {
+    if (index_mark(0)->line != 0 || index_mark(0)->offset != 0) return 0;
+    if (index_marks_hash(h->marks) != h->marks_hash) return 0;
+    for (size_t i = 1; i < h->marks; i++) {
+        IndexMark *m = index_mark(i), *prev = index_mark(i - 1);
+        if (m->line <= prev->line || m->offset <= prev->offset || m->offset > h->size || m->line > h->newlines) return 0;
+    }
+    return 1;
+}
+
+// Reuse a cache file if it still matches the start of the file: either the
+// file is unchanged or it has only grown since. A grown file may also have
+// been rewritten, so its whole prefix has to match the digest; hashing it
+// takes as long as scanning it, so the marks are used right away and the
+// worker checks the digest. Text decompressed from a file is the same
+// while the file is; hashing it would decompress it, so only the file is
+// compared.
+static void index_load_cache() {
+    LineIndex *ix = &line_index;
+    struct stat st;
+    if (!ix->cache_path[0] || ix->size < INDEX_CACHE_MIN || stat(ix->filename, &st) != 0) return;
+    FILE *f = fopen(ix->cache_path, "rb");
+    if (!f) return;
+    IndexCacheHeader h;
+    if (fread(&h, sizeof(h), 1, f) != 1 || memcmp(h.magic, INDEX_CACHE_MAGIC, 8) != 0 ||
+        h.size > ix->size || h.marks == 0 || h.marks >> INDEX_BLOCK_BITS >= INDEX_BLOCKS) {
+        fclose(f);
+        return;
+    }
+    int same = h.file_size == (uint64_t)st.st_size && h.mtime_sec == st.st_mtim.tv_sec &&
+               h.mtime_nsec == st.st_mtim.tv_nsec;
+    // Rewritten in place with the same size, or not a prefix any more
+    if (ix->derived ? !same
+                    : (!same && h.file_size == (uint64_t)st.st_size) ||
+                      index_fingerprint(ix->data, h.size) != h.fingerprint) {
+        fclose(f);
+        return;
+    }
+    size_t marks = 0;
+    while (marks < h.marks) {
+        size_t n = INDEX_BLOCK - (marks & (INDEX_BLOCK - 1));
+        if (n > h.marks - marks) n = h.marks - marks;
+        IndexMark **block = &ix->blocks[marks >> INDEX_BLOCK_BITS];
+        if (!*block) *block = malloc(sizeof(IndexMark) * INDEX_BLOCK);
+        if (fread(*block + (marks & (INDEX_BLOCK - 1)), sizeof(IndexMark), n, f) != n) break;
+        marks += n;
+    }
+    fclose(f);
+    if (marks < h.marks || !index_cache_marks(&h)) {
+        index_put(0, 0, 0);  // Read over by the damaged cache
+        return;
+    }
+    ix->cached = h.size;
+    if (!same) {
+        ix->unverified = h.size;
+        ix->cached_digest = h.digest;
+    }
+    index_publish(marks, h.newlines, h.size);
+}
+
+// Write the index out for the next time this file is opened. The worker
+// is stopped first, so the size, the line count and the marks saved are
+// all from the same point of the scan.
+void index_save_cache() {
+    LineIndex *ix = &line_index;
+    index_stop();
+    size_t scanned = atomic_load(&ix->scanned);
+    struct stat st;
+    // Marks not checked against the file are not saved for the next time
+    if (ix->unverified) index_verify();
+    if (!ix->cache_path[0] || scanned < INDEX_CACHE_MIN || scanned == ix->cached) return;
+    if (!ix->data || stat(ix->filename, &st) != 0) return;
+    // Cut short since it was indexed: the mapping past the new end would fault
+    if (!ix->derived && (uint64_t)st.st_size < scanned) return;
+
+    char tmp[sizeof(ix->cache_path) + 128];
+    cache_mkdir(ix->cache_path);
+
+    IndexCacheHeader h;
+    memset(&h, 0, sizeof(h));
+    memcpy(h.magic, INDEX_CACHE_MAGIC, 8);
+    h.size = scanned;
+    h.mtime_sec = st.st_mtim.tv_sec;
+    h.mtime_nsec = st.st_mtim.tv_nsec;
+    h.file_size = st.st_size;
+    if (!ix->derived) {
+        h.fingerprint = index_fingerprint(ix->data, scanned);
+        h.digest = index_digest(scanned);
+    }
+    h.newlines = atomic_load(&ix->newlines);
+    h.marks = atomic_load(&ix->marks);
+    h.marks_hash = index_marks_hash(h.marks);
+
+    snprintf(tmp, sizeof(tmp), "%s.%d", ix->cache_path, (int)getpid());
+    FILE *f = fopen(tmp, "wb");
+    if (!f) return;
+    int ok = fwrite(&h, sizeof(h), 1, f) == 1;
+    for (size_t i = 0; ok && i < h.marks; i += INDEX_BLOCK) {
+        size_t n = h.marks - i < INDEX_BLOCK ? h.marks - i : INDEX_BLOCK;
+        ok = fwrite(ix->blocks[i >> INDEX_BLOCK_BITS], sizeof(IndexMark), n, f) == n;
+    }
+    if (fclose(f) != 0) ok = 0;
+    if (!ok || rename(tmp, ix->cache_path) != 0) unlink(tmp);
+}
+
+// The text indexed is no longer the file's, as when a followed file was
+// truncated or replaced: index_save_cache() leaves the cache alone
+void index_drop_cache() {
+    line_index.cache_path[0] = 0;
+}
+
+static void index_reset(const char *data, size_t size) {
+    if (!scan_newlines) index_init();
+    LineIndex *ix = &line_index;
+    ix->data = data;
+    ix->size = size;
+    ix->cached = 0;
+    ix->unverified = 0;
+    ix->digested = 0;
+    atomic_store(&ix->stale, 0);
+    index_put(0, 0, 0);
+    atomic_store(&ix->marks, 1);
+    atomic_store(&ix->newlines, 0);
+    atomic_store(&ix->scanned, 0);
+    atomic_store(&ix->done, size == 0);
+    atomic_store(&ix->stop, 0);
+}
+
+static void index_launch() {
+    LineIndex *ix = &line_index;
+    ix->running = pthread_create(&ix->thread, NULL, index_worker, NULL) == 0;
+    if (!ix->running) {
+        if (ix->unverified) index_verify();
+        while (!index_done()) index_step(INDEX_SLICE);
+    }
+}
+
+// Index data[0..size) of the file `filename` (NULL for text that is not
+// a file), or when `derived` of the text decompressed from it: a cache
+// from an earlier run is picked up if it still matches, otherwise the
+// first `lines` lines are found right away. The rest is scanned by a
+// background thread.
+void index_start(const char *filename, int derived, const char *data, size_t size, size_t lines) {
+    LineIndex *ix = &line_index;
+    index_reset(data, size);
+    ix->filename = filename;
+    ix->derived = derived;
+    if (!filename || !cache_path(filename, derived ? "tdx" : "idx", ix->cache_path, sizeof(ix->cache_path))) {
+        ix->cache_path[0] = 0;
+    }
+    index_load_cache();
+    while (!index_done() && index_lines() < lines) {
+        index_step(64 << 10);
+    }
+    if (!index_done() || ix->unverified) index_launch();
+}
+
+// The text now runs on to data[0..size), with what was indexed so far
+// unchanged: only the bytes after it are scanned, right away when there
+// are few of them and in the background otherwise
+void index_grow(const char *data, size_t size) {
+    LineIndex *ix = &line_index;
+    index_stop();
+    ix->data = data;
+    ix->size = size;
+    atomic_store(&ix->stop, 0);
+    if (atomic_load(&ix->scanned) >= size) {
+        if (ix->unverified) index_launch();  // Stopped before it was checked
+        return;
+    }
+    atomic_store(&ix->done, 0);
+    for (int i = 0; i < 16 && !index_done(); i++) index_step(64 << 10);
+    if (!index_done() || ix->unverified) index_launch();
+}
+
+// Start over on data[0..size), a new version of the text whose layout is
+// known: as after a save, when the lines are handed over in order either
+// one at a time to index_append() or as runs of lines from the previous
+// version to index_append_lines(), which moves their marks over
+static IndexMark **index_old;
+static size_t index_old_marks;
+
+void index_rebuild(const char *data, size_t size) {
+    LineIndex *ix = &line_index;
+    index_stop();
+    index_old = malloc(sizeof(ix->blocks));
+    memcpy(index_old, ix->blocks, sizeof(ix->blocks));
+    index_old_marks = atomic_load(&ix->marks);
+    memset(ix->blocks, 0, sizeof(ix->blocks));
+    index_reset(data, size);
+    atomic_store(&ix->done, 0);
+}
+
+// One more line ends, the next one starts at offset
+void index_append(uint64_t offset) {
+    LineIndex *ix = &line_index;
+    size_t marks = atomic_load(&ix->marks), newlines = atomic_load(&ix->newlines) + 1;
+    IndexMark *last = index_mark(marks - 1);
+    if ((newlines - last->line >= INDEX_STRIDE || offset - last->offset >= INDEX_MARK_BYTES) &&
+        index_put(marks, newlines, offset)) {
+        marks++;
+    }
+    atomic_store(&ix->marks, marks);
+    atomic_store(&ix->newlines, newlines);
+}
+
+// Lines from `line` of the previous version on, ending in `newlines`
+// newlines, now start `shift` bytes further on
+void index_append_lines(size_t line, size_t newlines, int64_t shift) {
+    LineIndex *ix = &line_index;
+    size_t marks = atomic_load(&ix->marks), base = atomic_load(&ix->newlines);
+    size_t lo = 0, hi = index_old_marks;
+    while (lo < hi) {
+        size_t mid = lo + (hi - lo) / 2;
+        IndexMark *m = &index_old[mid >> INDEX_BLOCK_BITS][mid & (INDEX_BLOCK - 1)];
+        if (m->line <= line) lo = mid + 1;
+        else hi = mid;
+    }
+    for (size_t i = lo; i < index_old_marks; i++) {
+        IndexMark *m = &index_old[i >> INDEX_BLOCK_BITS][i & (INDEX_BLOCK - 1)];
+        if (m->line > line + newlines) break;
+        if (index_put(marks, base + m->line - line, m->offset + shift)) marks++;
+    }
+    atomic_store(&ix->marks, marks);
+    atomic_store(&ix->newlines, base + newlines);
+}
+
+void index_rebuild_done() {
+    index_publish(atomic_load(&line_index.marks), atomic_load(&line_index.newlines), line_index.size);
+    // The worker only has the digest left to do
+    if (index_digest_wanted()) line_index.running = pthread_create(&line_index.thread, NULL, index_worker, NULL) == 0;
+    for (size_t i = 0; i < INDEX_BLOCKS && index_old[i]; i++) free(index_old[i]);
+    free(index_old);
+    index_old = NULL;
+}
+
+void index_stop() {
+    if (line_index.running) {
+        atomic_store(&line_index.stop, 1);
+        pthread_join(line_index.thread, NULL);
+        line_index.running = 0;
+    }
+}
+
+int index_done() {
+    return atomic_load(&line_index.done);
+}
+
+// The cache file the index started from turned out not to be this file's
+int index_stale() {
+    return atomic_load(&line_index.stale);
+}
+
+// Percent of the file scanned
+int index_progress() {
+    if (line_index.size == 0) return 100;
+    return (int)(atomic_load(&line_index.scanned) * 100 / line_index.size);
+}
+
+// Complete lines found so far; once done, the text after the last newline
+// is one more line unless it is empty (the empty file has one line)
+size_t index_lines() {
+    size_t n = atomic_load(&line_index.newlines);
+    if (!atomic_load(&line_index.done)) return n;
+    if (line_index.size == 0 || line_index.data[line_index.size - 1] != '\n') n++;
+    return n;
+}
+
+// Block until at least `lines` lines are indexed or the scan is over
+size_t index_wait(size_t lines) {
+    LineIndex *ix = &line_index;
+    size_t n = index_lines();
+    if (n >= lines || index_done()) return n;
+    pthread_mutex_lock(&ix->lock);
+    while ((n = index_lines()) < lines && !index_done()) {
+        pthread_cond_wait(&ix->cond, &ix->lock);
+    }
+    pthread_mutex_unlock(&ix->lock);
+    return index_lines();
+}
+
+// Offset of the first byte of line i (below index_lines()): binary search
+// for the closest mark, then skip the remaining newlines
+uint64_t index_line_start(size_t i) {
+    size_t lo = 0, hi = atomic_load(&line_index.marks);
+    while (hi - lo > 1) {
+        size_t mid = lo + (hi - lo) / 2;
+        if (index_mark(mid)->line <= i) lo = mid;
+        else hi = mid;
+    }
+    uint64_t pos = index_mark(lo)->offset, at = pos;
+    size_t skip = i - index_mark(lo)->line;
+    uint64_t found[64];
+    // A mark at a time, compressed text is filled in as far as it is read
+    while (skip > 0 && at < line_index.size) {
+        size_t len = line_index.size - at < INDEX_MARK_BYTES ? line_index.size - at : INDEX_MARK_BYTES;
+        size_t scanned;
+        seek_need(line_index.data + at, len);
+        size_t n = scan_newlines(line_index.data + at, len, at, found, skip < 64 ? skip : 64, &scanned);
+        at += scanned;
+        if (n == 0) continue;
+        pos = found[n - 1];
+        skip -= n;
+    }
+    return pos;
+}
+
+void index_free() {
+    index_stop();
+    for (size_t i = 0; i < INDEX_BLOCKS && line_index.blocks[i]; i++) {
+        free(line_index.blocks[i]);
+        line_index.blocks[i] = NULL;
+    }
+    free(line_index.digests);
+    line_index.digests = NULL;
+    line_index.digested = line_index.digests_room = 0;
+    atomic_store(&line_index.marks, 0);
+    atomic_store(&line_index.newlines, 0);
+    line_index.data = NULL;
+    line_index.size = 0;
+}
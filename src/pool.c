@@ -0,0 +1,104 @@
+// pool.c thread pool for data-parallel jobs
+
+#include "tv.h"
+#include <pthread.h>
+#include <stdatomic.h>
+
+#define POOL_MAX 64
+
+// One job at a time: tasks 0..count-1 are handed out through an atomic
+// counter to the workers and to the thread that called pool_run()
+typedef struct {
+    pthread_t threads[POOL_MAX];
+    int size;                    // Worker threads, the caller makes one more
+    pthread_mutex_t job_lock;    // Serializes pool_run() callers
+    pthread_mutex_t lock;
+    pthread_cond_t wake, idle;
+    unsigned long generation;    // Bumped for every job
+    void (*fn)(size_t task, void *arg);
+    void *arg;
+    size_t count;
+    atomic_size_t next;          // Next task to hand out
+    int busy;                    // Workers still in the current job
+    int quit;
+} Pool;
+
+Pool pool = {.job_lock = PTHREAD_MUTEX_INITIALIZER, .lock = PTHREAD_MUTEX_INITIALIZER,
+             .wake = PTHREAD_COND_INITIALIZER, .idle = PTHREAD_COND_INITIALIZER};
+
+static void pool_work() {
+    size_t task;
+    while ((task = atomic_fetch_add(&pool.next, 1)) < pool.count) {
+        pool.fn(task, pool.arg);
+    }
+}
+
+static void *pool_thread(void *unused) {
+    unsigned long seen = 0;
+    pthread_mutex_lock(&pool.lock);
+    while (1) {
+        while (pool.generation == seen && !pool.quit) pthread_cond_wait(&pool.wake, &pool.lock);
+        if (pool.quit) break;
+        seen = pool.generation;
+        pthread_mutex_unlock(&pool.lock);
+        pool_work();
+        pthread_mutex_lock(&pool.lock);
+        if (--pool.busy == 0) pthread_cond_signal(&pool.idle);
+    }
+    pthread_mutex_unlock(&pool.lock);
+    return NULL;
+}
+
+static pthread_once_t pool_once = PTHREAD_ONCE_INIT;
+
+static void pool_start() {
+    pthread_mutex_lock(&pool.lock);
+    int quit = pool.quit;  // pool_free() came first, run jobs inline
+    pthread_mutex_unlock(&pool.lock);
+    if (quit) return;
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    int want = cpus > 1 ? (cpus > POOL_MAX ? POOL_MAX : (int)cpus) - 1 : 0;
+    while (pool.size < want &&
+           pthread_create(&pool.threads[pool.size], NULL, pool_thread, NULL) == 0) {
+        pool.size++;
+    }
+}
+
+// Threads taking part in a job, including the caller. The workers are
+// started by whichever thread asks first; the others wait for them, so
+// every caller sees the same size.
+int pool_threads() {
+    pthread_once(&pool_once, pool_start);
+    return pool.size + 1;
+}
+
+// Run fn(task, arg) for every task in 0..count-1 and wait for all of them
+void pool_run(size_t count, void (*fn)(size_t task, void *arg), void *arg) {
+    pthread_mutex_lock(&pool.job_lock);
+    pool_threads();
+    pthread_mutex_lock(&pool.lock);
+    pool.fn = fn;
+    pool.arg = arg;
+    pool.count = count;
+    atomic_store(&pool.next, 0);
+    pool.busy = pool.size;
+    pool.generation++;
+    pthread_cond_broadcast(&pool.wake);
+    pthread_mutex_unlock(&pool.lock);
+
+    pool_work();
+
+    pthread_mutex_lock(&pool.lock);
+    while (pool.busy > 0) pthread_cond_wait(&pool.idle, &pool.lock);
+    pthread_mutex_unlock(&pool.lock);
+    pthread_mutex_unlock(&pool.job_lock);
+}
+
+void pool_free() {
+    pthread_mutex_lock(&pool.lock);
+    pool.quit = 1;
+    pthread_cond_broadcast(&pool.wake);
+    pthread_mutex_unlock(&pool.lock);
+    for (int i = 0; i < pool.size; i++) pthread_join(pool.threads[i], NULL);
+    pool.size = 0;
+}
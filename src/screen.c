@@ -0,0 +1,280 @@
+// screen.c cell grid: drawing goes into a back buffer, a flush sends the
+// terminal only the cells that differ from what it shows already
+
+#include "tv.h"
+#include <stdarg.h>
+
+#define SCREEN_STYLES 32
+#define SCREEN_GAP 4  // Unchanged cells rewritten rather than jumped over
+
+typedef struct {
+    char text[12];  // UTF-8 of the character and combining marks after it
+    uint8_t len;    // 0 for the right half of a wide character
+    uint8_t width;
+    uint8_t style;
+} Cell;
+
+typedef struct {
+    int rows, cols;
+    Cell *back;     // Frame being drawn
+    Cell *front;    // What the terminal shows
+    int valid;      // Front is known, otherwise the next flush repaints
+    int cursor_row, cursor_col;
+    int shown_row, shown_col;  // Cursor position after the last flush
+    const char *styles[SCREEN_STYLES];
+    int style_count;
+    int sync;       // Wrap frames in synchronized output (mode 2026)
+    char *out;      // Frame being sent, reused from frame to frame
+    size_t out_len, out_capacity;
+    size_t frame_bytes;  // Bytes and write() calls of the last frame
+    int frame_writes;
+} Screen;
+
+Screen screen = {.sync = 1};
+
+// Styles are SGR sequences applied on top of a reset, kept by id in cells
+static int screen_style(const char *sgr) {
+    for (int i = 0; i < screen.style_count; i++) {
+        if (screen.styles[i] == sgr || strcmp(screen.styles[i], sgr) == 0) return i;
+    }
+    if (screen.style_count == SCREEN_STYLES) return 0;
+    screen.styles[screen.style_count] = sgr;
+    return screen.style_count++;
+}
+
+void screen_resize(int rows, int cols) {
+    Screen *s = &screen;
+    const char *sync = getenv("TV_SYNC");
+    if (sync) s->sync = atoi(sync);
+    s->rows = rows > 0 ? rows : 1;
+    s->cols = cols > 0 ? cols : 1;
+    free(s->back);
+    free(s->front);
+    s->back = calloc((size_t)s->rows * s->cols, sizeof(Cell));
+    s->front = calloc((size_t)s->rows * s->cols, sizeof(Cell));
+    screen_fill(1, 1, s->rows * s->cols, "");
+    s->valid = 0;
+}
+
+// Repaint everything on the next flush
+void screen_invalidate() {
+    screen.valid = 0;
+}
+
+static inline Cell *screen_cell(int row, int col) {
+    return &screen.back[(size_t)(row - 1) * screen.cols + col - 1];
+}
+
+// Fill n cells from (row, col) with blanks, wrapping onto the next rows
+void screen_fill(int row, int col, int n, const char *style) {
+    if (row < 1 || row > screen.rows || col < 1) return;
+    int id = screen_style(style);
+    Cell *c = screen_cell(row, col), *end = screen.back + (size_t)screen.rows * screen.cols;
+    for (; n > 0 && c < end; n--, c++) {
+        c->text[0] = ' ';
+        c->len = c->width = 1;
+        c->style = id;
+    }
+}
+
+// Draw len bytes of UTF-8 text from (row, col) up to column max, returns
+// the column after the last character drawn. Tabs show as a blank and
+// other control characters as '?', one column each.
+int screen_text(int row, int col, const char *text, size_t len, int max, const char *style) {
+    if (row < 1 || row > screen.rows) return col;
+    if (max > screen.cols + 1) max = screen.cols + 1;
+    int id = screen_style(style);
+    Cell *last = NULL;
+    for (size_t i = 0; i < len && col < max;) {
+        size_t bytes;
+        uint32_t cp = utf8_to_codepoint(text, i, len, &bytes);
+        if (bytes > len - i) bytes = len - i;
+        int width = utf8_char_width(cp);
+        if (width == 0 && cp != 0) {
+            // Combining mark, goes with the character before it
+            if (last && last->len + bytes <= sizeof(last->text)) {
+                memcpy(last->text + last->len, text + i, bytes);
+                last->len += bytes;
+            }
+            i += bytes;
+            continue;
+        }
+        Cell *c = screen_cell(row, col);
+        c->style = id;
+        c->width = 1;
+        if (cp == 0 || cp < 32 || cp == 127) {
+            c->text[0] = cp == '\t' ? ' ' : '?';
+            c->len = 1;
+        } else if (width == 2 && col + 1 >= max) {
+            c->text[0] = ' ';  // No room for the right half
+            c->len = 1;
+        } else {
+            memcpy(c->text, text + i, bytes);
+            c->len = bytes;
+            c->width = width;
+            if (width == 2) {
+                c[1].len = c[1].width = 0;
+                c[1].style = id;
+            }
+        }
+        last = c;
+        col += c->width;
+        i += bytes;
+    }
+    return col;
+}
+
+int screen_printf(int row, int col, const char *style, const char *fmt, ...) {
+    char text[1024];
+    va_list args;
+    va_start(args, fmt);
+    int len = vsnprintf(text, sizeof(text), fmt, args);
+    va_end(args);
+    if (len < 0) return col;
+    if (len >= (int)sizeof(text)) len = sizeof(text) - 1;
+    return screen_text(row, col, text, len, screen.cols + 1, style);
+}
+
+// Where the terminal cursor is left after the frame
+void screen_cursor(int row, int col) {
+    screen.cursor_row = row;
+    screen.cursor_col = col;
+}
+
+// Frames are built in memory and sent with as few write() calls as the
+// terminal takes, normally one
+static void screen_out(const char *data, size_t len) {
+    Screen *s = &screen;
+    if (s->out_len + len > s->out_capacity) {
+        s->out_capacity = s->out_capacity * 2 > s->out_len + len ? s->out_capacity * 2 : s->out_len + len + 4096;
+        s->out = realloc(s->out, s->out_capacity);
+    }
+    memcpy(s->out + s->out_len, data, len);
+    s->out_len += len;
+}
+
+static void screen_puts(const char *text) {
+    screen_out(text, strlen(text));
+}
+
+static void screen_move(int row, int col) {
+    char seq[32];
+    screen_out(seq, snprintf(seq, sizeof(seq), "\x1b[%d;%dH", row, col));
+}
+
+static void screen_send() {
+    Screen *s = &screen;
+    size_t sent = 0;
+    s->frame_bytes = s->out_len;
+    s->frame_writes = 0;
+    while (sent < s->out_len) {
+        ssize_t bytes = write(STDOUT_FILENO, s->out + sent, s->out_len - sent);
+        s->frame_writes++;
+        if (bytes < 0 && errno == EINTR) continue;
+        if (bytes <= 0) break;
+        sent += bytes;
+    }
+    s->out_len = 0;
+}
+
+// Size of the last frame sent, for profiling
+void screen_stats(size_t *bytes, int *writes) {
+    *bytes = screen.frame_bytes;
+    *writes = screen.frame_writes;
+}
+
+static inline int cell_same(const Cell *a, const Cell *b) {
+    return a->len == b->len && a->width == b->width && a->style == b->style &&
+           memcmp(a->text, b->text, a->len) == 0;
+}
+
+// Wide characters partly drawn over turn into blanks
+static void screen_repair(Cell *row, int cols) {
+    for (int c = 0; c < cols; c++) {
+        int lead = row[c].len && row[c].width == 2;
+        if (lead && (c + 1 == cols || row[c + 1].len)) {
+            row[c].text[0] = ' ';
+            row[c].len = row[c].width = 1;
+        } else if (!row[c].len) {
+            row[c].text[0] = ' ';
+            row[c].len = row[c].width = 1;
+        } else if (lead) {
+            c++;
+        }
+    }
+}
+
+// Send what changed since the last frame. The cursor is moved only across
+// runs of unchanged cells that are too long to simply write again.
+void screen_flush() {
+    Screen *s = &screen;
+    int row = -1, col = -1, style = -1, sent = 0;
+    if (!s->valid) {
+        if (s->sync) screen_puts("\x1b[?2026h");
+        screen_puts("\x1b[0m\x1b[2J");
+        for (size_t i = 0; i < (size_t)s->rows * s->cols; i++) s->front[i].len = 0xff;
+        s->valid = sent = 1;
+    }
+    for (int r = 1; r <= s->rows; r++) {
+        Cell *back = screen_cell(r, 1), *front = s->front + (size_t)(r - 1) * s->cols;
+        screen_repair(back, s->cols);
+        for (int c = 0; c < s->cols;) {
+            if (cell_same(&back[c], &front[c])) {
+                c++;
+                continue;
+            }
+            if (back[c].len == 0 && c > 0) c--;  // Right half, redraw the whole character
+            if (!sent && s->sync) screen_puts("\x1b[?2026h");
+            sent = 1;
+            if (row == r && col <= c && c - col <= SCREEN_GAP) {
+                // Rewrite the few unchanged cells in between
+                while (col < c && back[col].len) {
+                    Cell *g = &back[col];
+                    if (g->style != style) {
+                        screen_puts("\x1b[0m");
+                        screen_puts(s->styles[g->style]);
+                        style = g->style;
+                    }
+                    screen_out(g->text, g->len);
+                    col += g->width;
+                }
+                if (col != c) screen_move(r, c + 1);
+            } else if (row == r && col < c) {
+                char seq[16];
+                screen_out(seq, snprintf(seq, sizeof(seq), "\x1b[%dC", c - col));
+            } else {
+                screen_move(r, c + 1);
+            }
+            Cell *cell = &back[c];
+            if (cell->style != style) {
+                screen_puts("\x1b[0m");
+                screen_puts(s->styles[cell->style]);
+                style = cell->style;
+            }
+            screen_out(cell->text, cell->len);
+            for (int w = 0; w < cell->width && c + w < s->cols; w++) front[c + w] = back[c + w];
+            c += cell->width;
+            row = r;
+            col = c;
+            if (col >= s->cols) row = -1;  // Pending wrap, position unknown
+        }
+    }
+    if (sent || s->shown_row != s->cursor_row || s->shown_col != s->cursor_col) {
+        if (!sent && s->sync) screen_puts("\x1b[?2026h");
+        screen_puts("\x1b[0m");
+        screen_move(s->cursor_row, s->cursor_col);
+        if (s->sync) screen_puts("\x1b[?2026l");
+        s->shown_row = s->cursor_row;
+        s->shown_col = s->cursor_col;
+    }
+    if (s->out_len) screen_send();
+}
+
+void screen_free() {
+    free(screen.back);
+    free(screen.front);
+    free(screen.out);
+    screen.back = screen.front = NULL;
+    screen.out = NULL;
+    screen.out_capacity = 0;
+}
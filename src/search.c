@@ -0,0 +1,591 @@
+// search.c substring search: a SIMD kernel and a worker thread that runs
+// a search over the text while the editor keeps reading keys
+
+#include "tv.h"
+#include <pthread.h>
+#include <stdatomic.h>
+#include <regex.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define SEARCH_X86 1
+#endif
+
+#define SEARCH_CHUNK (1 << 20)  // Bytes searched between checks for cancellation
+#define REGEX_SLICE (1 << 20)   // Bytes per slice of a regular expression search
+#define REGEX_ROUND 4           // Slices per thread between publishing hits
+#define HIT_BLOCK_BITS 12
+#define HIT_BLOCK (1 << HIT_BLOCK_BITS)  // Hits per block
+#define HIT_BLOCKS (1 << 16)             // Up to 256M hits
+
+// Bytes by how often they show up in text and code, most common first.
+// Bytes not listed are taken to be rare.
+static const char search_common[] =
+    " etaoinsrlhdcumpfgybwvk_.,;:()=-/\"'0123456789xjqz*ETAOINSRLHDCUMPFGYBWVKXJQZ";
+
+static int search_rank(unsigned char c) {
+    if (c >= 0x80 && c < 0xc0) return 0;   // UTF-8 continuation bytes
+    if (c == 0xd0 || c == 0xd1) return 1;  // Cyrillic lead bytes
+    const char *p = memchr(search_common, c, sizeof(search_common) - 1);
+    return p ? (int)(p - search_common) + 2 : 255;
+}
+
+// A needle is matched by testing its two rarest bytes first, at offsets
+// a and b, and comparing in full only where both are there
+typedef struct {
+    const char *text;
+    size_t len;
+    size_t a, b;
+} Needle;
+
+static Needle search_needle(const char *text, size_t len) {
+    Needle nd = {text, len, 0, 0};
+    int ra = -1, rb = -1;
+    for (size_t i = 0; i < len; i++) {
+        int r = search_rank(text[i]);
+        if (r > ra) {
+            nd.b = nd.a;
+            rb = ra;
+            nd.a = i;
+            ra = r;
+        } else if (r > rb) {
+            nd.b = i;
+            rb = r;
+        }
+    }
+    if (rb < 0) nd.b = nd.a;
+    return nd;
+}
+
+static inline int search_match(const char *p, const Needle *nd) {
+    return memcmp(p, nd->text, nd->len) == 0;
+}
+
+static const char *find_scalar(const char *data, size_t len, const Needle *nd) {
+    if (len < nd->len) return NULL;
+    size_t last = len - nd->len, p = 0;
+    char ca = nd->text[nd->a], cb = nd->text[nd->b];
+    while (p <= last) {
+        const char *q = memchr(data + p + nd->a, ca, last - p + 1);
+        if (!q) return NULL;
+        p = q - data - nd->a;
+        if (data[p + nd->b] == cb && search_match(data + p, nd)) return data + p;
+        p++;
+    }
+    return NULL;
+}
+
+static const char *find_last_scalar(const char *data, size_t len, const Needle *nd) {
+    if (len < nd->len) return NULL;
+    char ca = nd->text[nd->a], cb = nd->text[nd->b];
+    for (size_t p = len - nd->len + 1; p-- > 0;) {
+        if (data[p + nd->a] == ca && data[p + nd->b] == cb && search_match(data + p, nd)) return data + p;
+    }
+    return NULL;
+}
+
+#ifdef SEARCH_X86
+// Bit k of the mask is set where a needle could start at p + k
+static const char *find_sse2(const char *data, size_t len, const Needle *nd) {
+    if (len < nd->len) return NULL;
+    size_t last = len - nd->len, p = 0;
+    __m128i va = _mm_set1_epi8(nd->text[nd->a]), vb = _mm_set1_epi8(nd->text[nd->b]);
+    for (; p + 16 <= last + 1; p += 16) {
+        __m128i ea = _mm_cmpeq_epi8(_mm_loadu_si128((const __m128i *)(data + p + nd->a)), va);
+        __m128i eb = _mm_cmpeq_epi8(_mm_loadu_si128((const __m128i *)(data + p + nd->b)), vb);
+        unsigned mask = _mm_movemask_epi8(_mm_and_si128(ea, eb));
+        for (; mask; mask &= mask - 1) {
+            const char *q = data + p + __builtin_ctz(mask);
+            if (search_match(q, nd)) return q;
+        }
+    }
+    return find_scalar(data + p, len - p, nd);
+}
+
+static const char *find_last_sse2(const char *data, size_t len, const Needle *nd) {
+    if (len < nd->len) return NULL;
+    size_t end = len - nd->len + 1;  // Candidates below end
+    __m128i va = _mm_set1_epi8(nd->text[nd->a]), vb = _mm_set1_epi8(nd->text[nd->b]);
+    for (; end >= 16; end -= 16) {
+        size_t p = end - 16;
+        __m128i ea = _mm_cmpeq_epi8(_mm_loadu_si128((const __m128i *)(data + p + nd->a)), va);
+        __m128i eb = _mm_cmpeq_epi8(_mm_loadu_si128((const __m128i *)(data + p + nd->b)), vb);
+        unsigned mask = _mm_movemask_epi8(_mm_and_si128(ea, eb));
+        while (mask) {
+            int k = 31 - __builtin_clz(mask);
+            if (search_match(data + p + k, nd)) return data + p + k;
+            mask &= ~(1u << k);
+        }
+    }
+    return end ? find_last_scalar(data, end + nd->len - 1, nd) : NULL;
+}
+
+__attribute__((target("avx2")))
+static const char *find_avx2(const char *data, size_t len, const Needle *nd) {
+    if (len < nd->len) return NULL;
+    size_t last = len - nd->len, p = 0;
+    __m256i va = _mm256_set1_epi8(nd->text[nd->a]), vb = _mm256_set1_epi8(nd->text[nd->b]);
+    for (; p + 32 <= last + 1; p += 32) {
+        __m256i ea = _mm256_cmpeq_epi8(_mm256_loadu_si256((const __m256i *)(data + p + nd->a)), va);
+        __m256i eb = _mm256_cmpeq_epi8(_mm256_loadu_si256((const __m256i *)(data + p + nd->b)), vb);
+        unsigned mask = _mm256_movemask_epi8(_mm256_and_si256(ea, eb));
+        for (; mask; mask &= mask - 1) {
+            const char *q = data + p + __builtin_ctz(mask);
+            if (search_match(q, nd)) return q;
+        }
+    }
+    return find_sse2(data + p, len - p, nd);
+}
+
+__attribute__((target("avx2")))
+static const char *find_last_avx2(const char *data, size_t len, const Needle *nd) {
+    if (len < nd->len) return NULL;
+    size_t end = len - nd->len + 1;
+    __m256i va = _mm256_set1_epi8(nd->text[nd->a]), vb = _mm256_set1_epi8(nd->text[nd->b]);
+    for (; end >= 32; end -= 32) {
+        size_t p = end - 32;
+        __m256i ea = _mm256_cmpeq_epi8(_mm256_loadu_si256((const __m256i *)(data + p + nd->a)), va);
+        __m256i eb = _mm256_cmpeq_epi8(_mm256_loadu_si256((const __m256i *)(data + p + nd->b)), vb);
+        unsigned mask = _mm256_movemask_epi8(_mm256_and_si256(ea, eb));
+        while (mask) {
+            int k = 31 - __builtin_clz(mask);
+            if (search_match(data + p + k, nd)) return data + p + k;
+            mask &= ~(1u << k);
+        }
+    }
+    return end ? find_last_sse2(data, end + nd->len - 1, nd) : NULL;
+}
+
+static size_t count_sse2(const char *data, size_t len) {
+    size_t n = 0, i = 0;
+    __m128i nl = _mm_set1_epi8('\n');
+    for (; i + 16 <= len; i += 16) {
+        n += __builtin_popcount(_mm_movemask_epi8(_mm_cmpeq_epi8(_mm_loadu_si128((const __m128i *)(data + i)), nl)));
+    }
+    for (; i < len; i++) n += data[i] == '\n';
+    return n;
+}
+
+__attribute__((target("avx2,popcnt")))
+static size_t count_avx2(const char *data, size_t len) {
+    size_t n = 0, i = 0;
+    __m256i nl = _mm256_set1_epi8('\n');
+    for (; i + 32 <= len; i += 32) {
+        n += __builtin_popcount(_mm256_movemask_epi8(_mm256_cmpeq_epi8(_mm256_loadu_si256((const __m256i *)(data + i)), nl)));
+    }
+    return n + count_sse2(data + i, len - i);
+}
+#endif
+
+static size_t count_scalar(const char *data, size_t len) {
+    size_t n = 0;
+    for (const char *p = data, *end = data + len; (p = memchr(p, '\n', end - p)); p++) n++;
+    return n;
+}
+
+// Picked on first use from what the CPU supports
+typedef struct {
+    const char *(*find)(const char *data, size_t len, const Needle *nd);
+    const char *(*find_last)(const char *data, size_t len, const Needle *nd);
+    size_t (*count)(const char *data, size_t len);
+} SearchKernel;
+
+static SearchKernel kernel;
+
+static const SearchKernel *search_kernel() {
+    if (!kernel.find) {
+        SearchKernel k = {find_scalar, find_last_scalar, count_scalar};
+#ifdef SEARCH_X86
+        __builtin_cpu_init();
+        if (__builtin_cpu_supports("avx2")) k = (SearchKernel){find_avx2, find_last_avx2, count_avx2};
+        else k = (SearchKernel){find_sse2, find_last_sse2, count_sse2};
+#endif
+        kernel = k;
+    }
+    return &kernel;
+}
+
+// First occurrence of needle in data[0..len), NULL if there is none
+const char *search_find(const char *data, size_t len, const char *needle, size_t n) {
+    if (n == 0 || n > len) return NULL;
+    Needle nd = search_needle(needle, n);
+    return search_kernel()->find(data, len, &nd);
+}
+
+// Last occurrence of needle in data[0..len)
+const char *search_find_last(const char *data, size_t len, const char *needle, size_t n) {
+    if (n == 0 || n > len) return NULL;
+    Needle nd = search_needle(needle, n);
+    return search_kernel()->find_last(data, len, &nd);
+}
+
+size_t count_newlines(const char *data, size_t len) {
+    return search_kernel()->count(data, len);
+}
+
+// The worker searches a snapshot of the text as runs of whole lines,
+// starting at an offset in one of them and wrapping around the end
+typedef struct {
+    SearchRun *runs;
+    size_t count;
+    size_t run, offset;     // Where the search starts
+    char *needle;
+    size_t len;
+    int backward;
+    int regex;              // needle is a regular expression, all hits are listed
+    SearchHit *blocks[HIT_BLOCKS];  // One hit per matching line, in order, in
+    atomic_size_t hit_count;        // fixed blocks read while more are added
+    pthread_t thread;
+    int running;
+    atomic_int cancel;
+    atomic_int state;
+    atomic_size_t scanned;  // Bytes searched so far
+    size_t total;
+    size_t line, col;       // The hit
+    int wrapped;            // Found after wrapping around
+    size_t end_line;        // Line the first byte past the runs is on, once all are listed
+} Search;
+
+Search search;
+
+// Line and column of byte h of run r. Newlines are counted from whichever
+// end of the run is nearer.
+static void search_locate(SearchRun *r, size_t h) {
+    if (r->newlines != SEARCH_UNKNOWN && h > r->len / 2) {
+        seek_need(r->data + h, r->len - h);
+        search.line = r->line + r->newlines - count_newlines(r->data + h, r->len - h);
+    } else {
+        seek_need(r->data, h);
+        search.line = r->line + count_newlines(r->data, h);
+    }
+    size_t start = h;
+    do {
+        size_t from = start > SEARCH_CHUNK ? start - SEARCH_CHUNK : 0;
+        seek_need(r->data + from, start - from);
+        while (start > from && r->data[start - 1] != '\n') start--;
+        if (start > from) break;
+    } while (start > 0);
+    search.col = h - start;
+}
+
+// Look for a hit starting in [from, to) of run r, nearest to from or, going
+// backward, to to. Returns 1 on a hit, -1 when cancelled.
+static int search_run(size_t r, size_t from, size_t to) {
+    SearchRun *run = &search.runs[r];
+    const SearchKernel *k = search_kernel();
+    Needle nd = search_needle(search.needle, search.len);
+    if (to > run->len) to = run->len;
+    while (from < to) {
+        if (atomic_load(&search.cancel)) return -1;
+        size_t lo = from, hi = to;  // Starts looked at in this chunk
+        if (to - from > SEARCH_CHUNK) {
+            if (search.backward) lo = to - SEARCH_CHUNK;
+            else hi = from + SEARCH_CHUNK;
+        }
+        size_t end = hi + search.len - 1 < run->len ? hi + search.len - 1 : run->len;
+        const char *hit = NULL;
+        seek_need(run->data + lo, end - lo);
+        if (end - lo >= search.len) {
+            hit = search.backward ? k->find_last(run->data + lo, end - lo, &nd)
+                                  : k->find(run->data + lo, end - lo, &nd);
+        }
+        if (hit) {
+            search_locate(run, hit - run->data);
+            return 1;
+        }
+        atomic_fetch_add(&search.scanned, hi - lo);
+        if (search.backward) to = lo;
+        else from = hi;
+    }
+    return 0;
+}
+
+static int search_all() {
+    Search *s = &search;
+    int found;
+    if (!s->backward) {
+        if ((found = search_run(s->run, s->offset, (size_t)-1))) return found;
+        for (size_t r = s->run + 1; r < s->count; r++) {
+            if ((found = search_run(r, 0, (size_t)-1))) return found;
+        }
+        s->wrapped = 1;
+        for (size_t r = 0; r < s->run; r++) {
+            if ((found = search_run(r, 0, (size_t)-1))) return found;
+        }
+        return search_run(s->run, 0, s->offset);
+    }
+    if ((found = search_run(s->run, 0, s->offset))) return found;
+    for (size_t r = s->run; r-- > 0;) {
+        if ((found = search_run(r, 0, (size_t)-1))) return found;
+    }
+    s->wrapped = 1;
+    for (size_t r = s->count; r-- > s->run + 1;) {
+        if ((found = search_run(r, 0, (size_t)-1))) return found;
+    }
+    return search_run(s->run, s->offset, (size_t)-1);
+}
+
+// A regular expression search lists every line that matches. The runs are
+// cut into slices at line boundaries and matched on the thread pool a few
+// rounds at a time. After each round its slices are stitched in order with
+// a prefix sum over their newline counts, the way the line index is built,
+// and the hits they found are published.
+typedef struct {
+    size_t run;
+    size_t from, to;        // Byte range in the run, whole lines
+    SearchHit *hits;        // Lines numbered from the start of the slice
+    size_t count, capacity;
+    size_t newlines;
+} RegexSlice;
+
+typedef struct {
+    RegexSlice *slices;
+    size_t count;           // Slices in this round
+    atomic_size_t next;     // Next slice to hand out
+    regex_t *res;           // One compiled copy per thread, glibc serializes
+                            // regexec() calls that share one
+} RegexJob;
+
+static void regex_slice(RegexSlice *sl, regex_t *re) {
+    SearchRun *run = &search.runs[sl->run];
+    size_t pos = sl->from, line = 0;
+    seek_need(run->data + sl->from, sl->to - sl->from);
+    while (pos < sl->to && !atomic_load(&search.cancel)) {
+        regmatch_t m = {pos, sl->to};
+        if (regexec(re, run->data, 1, &m, REG_STARTEND)) break;
+        size_t h = m.rm_so, start = h;
+        line += count_newlines(run->data + pos, h - pos);
+        while (start > pos && run->data[start - 1] != '\n') start--;
+        // One hit per line, go on from the next one
+        const char *nl = memchr(run->data + h, '\n', sl->to - h);
+        size_t end = nl ? (size_t)(nl - run->data) : sl->to;
+        if (sl->count == sl->capacity) {
+            sl->capacity = sl->capacity ? sl->capacity * 2 : 256;
+            sl->hits = realloc(sl->hits, sizeof(SearchHit) * sl->capacity);
+        }
+        sl->hits[sl->count++] = (SearchHit){line, h - start, run->data + start, end - start};
+        pos = end + 1;
+        if (!nl) break;
+        line++;
+    }
+    if (pos > sl->to) pos = sl->to;
+    sl->newlines = line + count_newlines(run->data + pos, sl->to - pos);
+    atomic_fetch_add(&search.scanned, sl->to - sl->from);
+}
+
+static void regex_task(size_t task, void *arg) {
+    RegexJob *job = arg;
+    size_t i;
+    while ((i = atomic_fetch_add(&job->next, 1)) < job->count) regex_slice(&job->slices[i], &job->res[task]);
+}
+
+// Append a hit, the count is published by the caller
+static int hit_add(size_t i, SearchHit hit) {
+    if (i >> HIT_BLOCK_BITS >= HIT_BLOCKS) return 0;
+    SearchHit **block = &search.blocks[i >> HIT_BLOCK_BITS];
+    if (!*block) *block = malloc(sizeof(SearchHit) * HIT_BLOCK);
+    (*block)[i & (HIT_BLOCK - 1)] = hit;
+    return 1;
+}
+
+static RegexSlice *regex_slices(size_t *count) {
+    Search *s = &search;
+    RegexSlice *slices = NULL;
+    size_t capacity = 0;
+    *count = 0;
+    for (size_t r = 0; r < s->count; r++) {
+        SearchRun *run = &s->runs[r];
+        for (size_t from = 0; from < run->len;) {
+            size_t to = run->len;
+            if (run->len - from > REGEX_SLICE) {
+                const char *nl = seek_newline(run->data + from + REGEX_SLICE, run->len - from - REGEX_SLICE);
+                if (nl) to = nl - run->data + 1;
+            }
+            if (*count == capacity) {
+                capacity = capacity ? capacity * 2 : 64;
+                slices = realloc(slices, sizeof(RegexSlice) * capacity);
+            }
+            slices[(*count)++] = (RegexSlice){r, from, to, NULL, 0, 0, 0};
+            from = to;
+        }
+    }
+    return slices;
+}
+
+static int regex_all() {
+    Search *s = &search;
+    int threads = pool_threads(), compiled = 0;
+    RegexJob job = {0};
+    job.res = malloc(sizeof(regex_t) * threads);
+    while (compiled < threads && regcomp(&job.res[compiled], s->needle, REG_EXTENDED | REG_NEWLINE) == 0) compiled++;
+    size_t count, hits = atomic_load(&s->hit_count), newlines = 0;  // Before the slice, in its run
+    RegexSlice *slices = compiled == threads ? regex_slices(&count) : NULL;
+    for (size_t first = 0; slices && first < count && !atomic_load(&s->cancel);) {
+        job.slices = slices + first;
+        job.count = count - first < (size_t)threads * REGEX_ROUND ? count - first : (size_t)threads * REGEX_ROUND;
+        atomic_store(&job.next, 0);
+        pool_run(threads, regex_task, &job);
+        if (atomic_load(&s->cancel)) break;
+        for (size_t i = first; i < first + job.count; i++) {
+            RegexSlice *sl = &slices[i];
+            if (i > 0 && slices[i - 1].run != sl->run) newlines = 0;
+            size_t base = s->runs[sl->run].line + newlines;
+            for (size_t j = 0; j < sl->count; j++) {
+                SearchHit hit = sl->hits[j];
+                hit.line += base;
+                hits += hit_add(hits, hit);
+            }
+            newlines += sl->newlines;
+            free(sl->hits);
+            sl->hits = NULL;
+        }
+        atomic_store(&s->hit_count, hits);
+        first += job.count;
+    }
+    if (slices && !atomic_load(&s->cancel)) {
+        size_t last = s->count - 1;
+        s->end_line = s->runs[last].line + (count && slices[count - 1].run == last ? newlines : 0);
+    }
+    for (size_t i = 0; slices && i < count; i++) free(slices[i].hits);
+    free(slices);
+    for (int i = 0; i < compiled; i++) regfree(&job.res[i]);
+    free(job.res);
+    if (atomic_load(&s->cancel) || compiled < threads) return -1;
+    return hits > 0;
+}
+
+static void *search_worker(void *unused) {
+    int found = search.regex ? regex_all() : search_all();
+    atomic_store(&search.state, found == 1 ? SEARCH_FOUND : found == 0 ? SEARCH_MISSING : SEARCH_CANCELLED);
+    event_post();
+    return NULL;
+}
+
+// Stop the search that is running, if any, and drop its snapshot
+void search_cancel() {
+    Search *s = &search;
+    if (s->running) {
+        atomic_store(&s->cancel, 1);
+        pthread_join(s->thread, NULL);
+        s->running = 0;
+    }
+    free(s->runs);
+    free(s->needle);
+    for (size_t i = 0; i < HIT_BLOCKS && s->blocks[i]; i++) {
+        free(s->blocks[i]);
+        s->blocks[i] = NULL;
+    }
+    s->runs = NULL;
+    s->needle = NULL;
+    atomic_store(&s->hit_count, 0);
+}
+
+// Start the worker on the runs set up in search
+static void search_go() {
+    Search *s = &search;
+    s->total = 0;
+    for (size_t i = 0; i < s->count; i++) s->total += s->runs[i].len;
+    atomic_store(&s->scanned, 0);
+    atomic_store(&s->cancel, 0);
+    atomic_store(&s->state, SEARCH_RUNNING);
+    if (s->len == 0 || s->count == 0 || (!s->regex && s->run >= s->count)) {
+        atomic_store(&s->state, SEARCH_MISSING);
+        return;
+    }
+    if (pthread_create(&s->thread, NULL, search_worker, NULL) == 0) {
+        s->running = 1;
+    } else {
+        search_worker(NULL);  // No thread, search right here
+    }
+}
+
+static void search_launch(SearchRun *runs, size_t count, size_t run, size_t offset,
+                          const char *needle, size_t n, int backward, int regex) {
+    Search *s = &search;
+    search_cancel();
+    search_kernel();  // Picked here, before the worker can race for it
+    s->runs = runs;
+    s->count = count;
+    s->run = run;
+    s->offset = offset;
+    s->needle = malloc(n + 1);
+    memcpy(s->needle, needle, n);
+    s->len = n;
+    s->needle[n] = 0;
+    s->backward = backward;
+    s->regex = regex;
+    s->wrapped = 0;
+    s->end_line = 0;
+    search_go();
+}
+
+// Search runs[0..count) for needle from offset in run `run`, on the worker.
+// The runs are owned by the search from now on.
+void search_start(SearchRun *runs, size_t count, size_t run, size_t offset,
+                  const char *needle, size_t n, int backward) {
+    search_launch(runs, count, run, offset, needle, n, backward, 0);
+}
+
+// List every line of runs[0..count) that the extended regular expression
+// matches, for search_hit()
+void search_start_regex(SearchRun *runs, size_t count, const char *pattern) {
+    search_launch(runs, count, 0, 0, pattern, strlen(pattern), 0, 1);
+}
+
+// Go on with the regular expression search that has listed all its runs,
+// over runs[0..count) that carry the text on from line `from`, the line
+// search_end_line() told. Its hits are dropped first, as that line may
+// have been cut short, and the new hits are added after the others.
+void search_more_regex(SearchRun *runs, size_t count, size_t from) {
+    Search *s = &search;
+    if (s->running) {
+        pthread_join(s->thread, NULL);
+        s->running = 0;
+    }
+    size_t hits = atomic_load(&s->hit_count);
+    while (hits > 0 && search_hit(hits - 1)->line >= from) hits--;
+    atomic_store(&s->hit_count, hits);
+    free(s->runs);
+    s->runs = runs;
+    s->count = count;
+    s->end_line = from;
+    search_go();
+}
+
+// Line the first byte after the text a regular expression search listed
+// is on: the last line when the text does not end with a newline
+size_t search_end_line() {
+    return search.end_line;
+}
+
+// Lines a regular expression search has found so far. The count only
+// grows while the search runs, hits below it stay where they are.
+size_t search_hit_count() {
+    return atomic_load(&search.hit_count);
+}
+
+// Hit i, in the order of the text
+SearchHit *search_hit(size_t i) {
+    return &search.blocks[i >> HIT_BLOCK_BITS][i & (HIT_BLOCK - 1)];
+}
+
+// SEARCH_RUNNING until the worker is done, then where the hit is
+int search_poll(size_t *line, size_t *col, int *wrapped) {
+    int state = atomic_load(&search.state);
+    if (state == SEARCH_FOUND) {
+        *line = search.line;
+        *col = search.col;
+        *wrapped = search.wrapped;
+    }
+    return state;
+}
+
+// Percent of the text searched
+int search_progress() {
+    if (search.total == 0) return 100;
+    return (int)(atomic_load(&search.scanned) * 100 / search.total);
+}
+
+void search_free() {
+    search_cancel();
+}
@@ -0,0 +1,211 @@
+// seek.c text of a compressed file that can be read anywhere at once. The
+// text is mapped at its full size, in units that start at the checkpoints
+// of the file. Whoever reads it asks for the range first with seek_need(),
+// which decompresses the units not there yet from their checkpoints, or
+// waits for them; going to a line or to the end only waits for the units
+// it reads. Meanwhile the rest is filled in on the pool. The text lives in
+// an unlinked file, like a long stream.
+
+#include "tv.h"
+#include <pthread.h>
+#include <stdatomic.h>
+
+#define SEEK_EMPTY 0
+#define SEEK_FILLING 1
+#define SEEK_FILLED 2
+#define SEEK_FAILED 3   // Reads as zeros
+#define SEEK_STEP (64 << 10)  // Bytes filled in at a time while looking for a line end
+
+typedef struct {
+    char *text;              // Where the text is read
+    char *out;               // The same pages, writable, where units are filled in
+    size_t size, room;       // Bytes of text, and of whole pages mapped for it
+    size_t *starts;          // Where every unit starts, then size
+    size_t units;
+    atomic_int *state;       // SEEK_* of every unit
+    int (*fill)(size_t unit, char *out, size_t from, size_t to, size_t *error_at);
+    int (*check)(size_t *error_at);
+    int spill;
+    pthread_t filler;
+    int filling;
+    atomic_int result;       // 0 while filling in, 1 done, -1 something could not be
+    atomic_int failed;
+    atomic_int stop;
+    size_t error_at;         // Where the first failure was, in the compressed file
+} Seek;
+
+static Seek seek = {.spill = -1};
+
+// An unlinked file for text that does not have to stay in memory, in
+// TMPDIR or else /var/tmp, which is on disk more often than /tmp
+int spill_open() {
+    const char *dir = getenv("TMPDIR");
+    char path[4096];
+    snprintf(path, sizeof(path), "%s/tv.XXXXXX", dir && *dir ? dir : "/var/tmp");
+    int spill = mkstemp(path);
+    if (spill != -1) unlink(path);
+    return spill;
+}
+
+static void seek_nap() {
+    struct timespec t = {0, 50000};
+    nanosleep(&t, NULL);
+}
+
+// The unit the text at offset is in: the last of those that start at or
+// before it, so empty units are passed over
+static size_t seek_unit(size_t offset) {
+    size_t lo = 0, hi = seek.units;
+    while (hi - lo > 1) {
+        size_t mid = lo + (hi - lo) / 2;
+        if (seek.starts[mid] <= offset) lo = mid;
+        else hi = mid;
+    }
+    return lo;
+}
+
+static void seek_failed(size_t at) {
+    int expect = 0;
+    if (atomic_compare_exchange_strong(&seek.failed, &expect, 1)) seek.error_at = at;
+}
+
+// Fill in a unit unless it is, or is being filled in by another thread,
+// then wait for that. Returns 0, or -1 when it could not be decompressed.
+static int seek_fill(size_t unit) {
+    Seek *s = &seek;
+    int expect = SEEK_EMPTY;
+    if (atomic_compare_exchange_strong(&s->state[unit], &expect, SEEK_FILLING)) {
+        size_t from = s->starts[unit], to = s->starts[unit + 1], at = 0;
+        int ok = from == to || s->fill(unit, s->out + from, from, to, &at) == 0;
+        if (!ok) seek_failed(at);
+        atomic_store(&s->state[unit], ok ? SEEK_FILLED : SEEK_FAILED);
+        return ok ? 0 : -1;
+    }
+    while (atomic_load(&s->state[unit]) == SEEK_FILLING) seek_nap();
+    return atomic_load(&s->state[unit]) == SEEK_FILLED ? 0 : -1;
+}
+
+// Fill in the units text[at..at + len) is in, or wait for them, before it
+// is read. Text seek.c does not hold is read as it is.
+void seek_need(const char *at, size_t len) {
+    Seek *s = &seek;
+    if (!s->text || at < s->text || at >= s->text + s->size || len == 0) return;
+    size_t from = at - s->text, to = len < s->size - from ? from + len : s->size;
+    for (size_t unit = seek_unit(from); unit < s->units && s->starts[unit] < to; unit++) {
+        if (atomic_load(&s->state[unit]) < SEEK_FILLED) seek_fill(unit);
+    }
+}
+
+// memchr() for a newline in text[at..at + len) that fills it in as it goes
+const char *seek_newline(const char *at, size_t len) {
+    Seek *s = &seek;
+    if (!s->text || at < s->text || at >= s->text + s->size) return memchr(at, '\n', len);
+    while (len > 0) {
+        size_t n = len < SEEK_STEP ? len : SEEK_STEP;
+        seek_need(at, n);
+        const char *nl = memchr(at, '\n', n);
+        if (nl) return nl;
+        at += n;
+        len -= n;
+    }
+    return NULL;
+}
+
+static void seek_task(size_t task, void *arg) {
+    seek_fill(*(size_t *)arg + task);
+}
+
+// The units nobody has read, a round at a time from the start, then the
+// checks that need all of the text
+static void *seek_filler(void *unused) {
+    Seek *s = &seek;
+    size_t round = pool_threads() * 2;
+    for (size_t first = 0; first < s->units && !atomic_load(&s->stop); first += round) {
+        pool_run(s->units - first < round ? s->units - first : round, seek_task, &first);
+    }
+    if (atomic_load(&s->stop)) return NULL;
+    size_t at = 0;
+    if (!atomic_load(&s->failed) && s->check && s->check(&at) != 0) seek_failed(at);
+    atomic_store(&s->result, atomic_load(&s->failed) ? -1 : 1);
+    event_post();
+    return NULL;
+}
+
+// Map text[0..size), in units starting at the offsets
+// points[0..count), the first of them 0. fill(unit, out, from, to,
+// error_at) decompresses text[from..to) into out, returning 0 or -1 with
+// where the bad data is; check(error_at) runs once all of it is filled in.
+int seek_open(char *text, size_t size, const uint64_t *points, size_t count,
+              int (*fill)(size_t unit, char *out, size_t from, size_t to, size_t *error_at),
+              int (*check)(size_t *error_at)) {
+    Seek *s = &seek;
+    size_t page = sysconf(_SC_PAGESIZE);
+    s->size = size;
+    s->room = (size + page - 1) & ~(page - 1);
+    s->spill = spill_open();
+    if (s->spill == -1 || ftruncate(s->spill, s->room) != 0) {
+        seek_close();
+        return -1;
+    }
+    s->out = mmap(NULL, s->room, PROT_READ | PROT_WRITE, MAP_SHARED, s->spill, 0);
+    if (s->out == MAP_FAILED) {
+        s->out = NULL;
+        seek_close();
+        return -1;
+    }
+    s->starts = malloc(sizeof(size_t) * (count + 1));
+    s->state = calloc(count, sizeof(atomic_int));
+    for (size_t i = 0; i < count; i++) {
+        size_t start = (points[i] + page - 1) & ~(page - 1);
+        s->starts[i] = i == 0 ? 0 : (start < size ? start : size);
+    }
+    s->starts[count] = size;
+    s->units = count;
+    s->fill = fill;
+    s->check = check;
+    atomic_store(&s->result, 0);
+    atomic_store(&s->failed, 0);
+    atomic_store(&s->stop, 0);
+    if (mmap(text, s->room, PROT_READ, MAP_SHARED | MAP_FIXED, s->spill, 0) == MAP_FAILED) {
+        seek_close();
+        return -1;
+    }
+    s->text = text;
+    return 0;
+}
+
+// Fill in the units nobody reads in the background
+void seek_start() {
+    Seek *s = &seek;
+    s->filling = pthread_create(&s->filler, NULL, seek_filler, NULL) == 0;
+    if (!s->filling) atomic_store(&s->result, 1);  // Only what is read gets filled in
+}
+
+// 0 while filling in, 1 when all of the text is there, -1 when some of it
+// could not be decompressed, the first bad data being at *at
+int seek_state(size_t *at) {
+    int result = atomic_load(&seek.result);
+    *at = seek.error_at;
+    return result;
+}
+
+// Stop filling in and let go of the text. The mapping at text is left to
+// the caller.
+void seek_close() {
+    Seek *s = &seek;
+    if (s->filling) {
+        atomic_store(&s->stop, 1);
+        pthread_join(s->filler, NULL);
+        s->filling = 0;
+    }
+    s->text = NULL;
+    if (s->out) munmap(s->out, s->room);
+    s->out = NULL;
+    if (s->spill != -1) close(s->spill);
+    s->spill = -1;
+    free(s->starts);
+    free((void *)s->state);
+    s->starts = NULL;
+    s->state = NULL;
+    s->units = 0;
+}
@@ -1,6 +1,12 @@
 // tv.c
 
 #include "tv.h"
+#include <assert.h>
+#include <regex.h>
+#include <sys/wait.h>
+#ifdef __linux__
+#include <sys/inotify.h>
+#endif
 
 // Colors from socha.h
 #define COLOR_HEADER "\x1b[1;97;104m"
@@ -9,10 +15,27 @@
 #define COLOR_LIGHT_BLUE "\x1b[104m"
 #define COLOR_WHITE "\x1b[1;37m" // Bright white for text
 #define COLOR_PINK_BG "\x1b[48;2;255;105;180m"
+#define COLOR_HIT "\x1b[30;103m"  // Search hits
 
 #define TAB_WIDTH  4
+#define FOLLOW_RESERVE ((size_t)1 << 40)  // Address space a followed file grows into
+#define STREAM_MEMORY (64 << 20)  // Bytes of standard input kept in memory
+#define STREAM_SPILL (16 << 20)   // Steps the spill file grows in past that
+#define STREAM_ROUND (16 << 20)   // Bytes read before looking at the keys again
+#define INPUT_BUFFER 4096
+#define ESC_WAIT 50               // Milliseconds for the rest of an escape sequence
+#define FRAME_NS 16666667         // Keys that keep coming are drawn at 60 frames a second
+#define PASTE_WAIT 1000           // Milliseconds a paste may stall before it is taken as over
+#define PROGRESS_MS 100           // How often the progress is redrawn while work goes on
 
 // Key codes from socha.h
+#define KEY_CTRL_F 6
+#define KEY_CTRL_G 7
+#define KEY_CTRL_N 14
+#define KEY_CTRL_P 16
+#define KEY_CTRL_R 18
+#define KEY_CTRL_U 21
+#define KEY_CTRL_Y 25
 #define KEY_TAB    9
 #define KEY_ESC    1000
 #define KEY_UP     1001
@@ -39,48 +62,107 @@
 #define KEY_CTRL_LEFT  1025
 #define KEY_CTRL_RIGHT 1026
 #define KEY_INSERT 1009
-
-#define MAX_LINE_SIZE (1ULL << 32)  // 4GB max line size
-#define CHUNK_SIZE 64000             // Buffer read chunk size
+#define KEY_CTRL_HOME  1027
+#define KEY_CTRL_END   1028
+#define KEY_PASTE  1029  // Bracketed paste, the text is in paste_buf
 
 // Global state
 struct termios orig_termios;
 int rows, cols;
-volatile sig_atomic_t resize_flag = 0;
+int resize_flag = 0;  // The terminal has a new size the screen has not taken yet
 char filename[1024];
 int fd = -1;
 off_t file_size = 0;
+char *file_map = NULL;  // Read-only mapping of the file, lines borrow from it until edited
+size_t map_size = 0;
+int map_copy = 0;  // file_map is a heap copy because the file could not be mapped
+char *map_base = NULL;  // Reserved address space file_map starts, while following
+int streaming = 0;  // The text is standard input (tv -) or decompressed, read as it arrives
+int stream_fd = -1;  // The pipe, -1 once it is over
+pid_t stream_pid = -1;  // Decompressor writing into the pipe
+const char *stream_tool = NULL;
+int compressed = 0;  // The file is compressed and the text what it holds
+int inflating = 0;  // gzip.c is still decompressing it
+int seeking = 0;  // Or it is all there at once, decompressed where it is read by
+                  // seek.c: 1 while the rest is filled in, 2 once it is
+char *zip_map = NULL;  // The compressed file
+size_t zip_size = 0;
+int stream_spill = -1;  // Unlinked file holding the input past STREAM_MEMORY
+size_t stream_room = 0;  // Bytes mapped at map_base to read into
+int trailing_newline = 0;  // File ended with '\n', written back on save
 int view_mode = 0;  // 0 = edit (default), 1 = view
 int modified = 0;
 int insert_mode = 1;  // 1 = insert, 0 = replace
 int show_blanks = 1;  // Toggle for blank space display (F5)
+int show_stats = 0;  // Size of the last frame in the header (TV_STATS=1)
+int follow = 0;  // Take in what is appended to the file (tv -f)
+int follow_pinned = 0;  // The last line is on screen, the view keeps it there
+int follow_fd = -1;  // inotify descriptor, -1 when the file is only checked with stat()
+int follow_wd = -1;
+int follow_moved = 0;  // The file was renamed or deleted, look for a new one by its name
+char status[256] = "";  // Message in the footer until the next key
+char search_text[256] = "";  // Last search, its hits are highlighted
+int searching = 0;  // A search is running, its progress is in the header
+int search_regex = 0;  // search_text is a regular expression, compiled in search_re
+int filtering = 0;  // Only the lines search_re matches are shown (F6)
+size_t filter_origin = 0;  // Line the cursor was on when filtering started
+size_t filter_size = 0;  // Bytes of file_map the filter has taken in
+regex_t search_re;
+unsigned long text_version = 0;  // Bumped by every edit
+unsigned long hits_version = -1;  // Text the regular expression hits were listed for
 
 // Line structure
 typedef struct Line {
     char *data;         // Line content (UTF-8)
     size_t len;         // Byte length of line (excluding \n)
-    size_t capacity;    // Allocated size
-    size_t disp_len;    // Display length (number of columns), computed on demand
+    uint32_t capacity;  // Storage in 16 byte units, 0 while data points into file_map
+    uint32_t width;     // Columns << 2 | LINE_MEASURED | LINE_ASCII, 0 until measured
 } Line;
 
+#define LINE_MEASURED 1  // width holds the columns of a line shorter than COLUMN_LINE
+#define LINE_ASCII 2     // and every byte of it is ASCII, one column each
+#define LINE_INLINE 192  // Edited lines shorter than this are kept in their piece's block
+
+// Text is kept as a sequence of pieces in a treap ordered by position and
+// augmented with line counts, so finding, inserting and removing a line
+// is O(log n) however long the file is. A piece is either a run of
+// untouched lines of the file, read through the line index, or a single
+// line that has been edited.
+typedef struct Piece {
+    struct Piece *left, *right;
+    size_t lines;       // Lines in this subtree
+    size_t count;       // Lines in this piece
+    uint32_t priority;  // Heap order of the treap
+    uint16_t block;     // Bytes of the piece's arena block / 16
+    uint16_t edited;
+    union {
+        size_t orig;    // First line in the file of a run
+        Line line;      // The edited line
+    };
+} Piece;
+
+#define EDITED ((size_t)-1)
+#define LINE_VIEWS 8  // Untouched lines handed out at a time
+
 // Line buffer
 typedef struct {
-    Line *lines;        // Array of lines
-    size_t count;       // Number of lines
-    size_t capacity;    // Allocated size
+    Piece *root;
+    size_t file_lines;  // Lines taken from the line index so far
+    Line views[LINE_VIEWS];  // Untouched lines handed out by get_line(), reused in turn
+    int view;
+    size_t next_line;   // File line after the last one viewed
+    uint64_t next_pos;  // and where it starts
 } LineBuffer;
 
 LineBuffer buffer = {0};
 size_t cursor_x = 0, cursor_y = 0;  // Cursor position (in byte offset)
 int scroll_x = 0, scroll_y = 0;     // Scroll offsets (in display columns)
-size_t last_cursor_x = -1;          // Last cursor byte offset
-int last_cursor_y = -1;             // Last cursor line
 
 // Prototypes
 void enable_raw_mode();
 void disable_raw_mode();
 int get_window_size(int *r, int *c);
-void handle_resize(int sig);
+void handle_resize();
 int get_input();
 void load_file();
 void draw_header();
@@ -90,96 +172,492 @@ int handle_menu();
 void draw_text();
 void update_line(int line);
 void insert_char(char c);
+void insert_text(const char *data, size_t len);
+void find_show(size_t y, size_t x);
+int paste_read();
 void delete_char();
-void save_file();
+int save_file();
 void move_cursor_word(int direction);
 void free_buffer();
+void line_own(Line *l, size_t need);
+void columns_forget(const char *data);
+size_t line_count();
+// An untouched line is only good until LINE_VIEWS more get_line() or
+// view_line() calls; line_edit() gives one that can be kept and changed
+Line *get_line(size_t y);
+size_t view_lines();
+Line *view_line(size_t y);
+size_t hit_after(size_t count, size_t y, size_t x, int inclusive);
+void filter_off();
+void filter_more();
+void follow_watch();
 
 // Line buffer functions
 void init_buffer() {
-    buffer.lines = malloc(sizeof(Line) * 1024);
-    buffer.count = 0;
-    buffer.capacity = 1024;
+    buffer.root = NULL;
+    buffer.file_lines = 0;
+    buffer.next_line = EDITED;
 }
 
-void grow_buffer() {
-    buffer.capacity *= 2;
-    buffer.lines = realloc(buffer.lines, sizeof(Line) * buffer.capacity);
+uint32_t piece_priority() {
+    static uint32_t state = 2463534242u;
+    state ^= state << 13;
+    state ^= state >> 17;
+    state ^= state << 5;
+    return state;
 }
 
-void add_line(char *data, size_t len) {
-    if (buffer.count >= buffer.capacity) grow_buffer();
-    Line *line = &buffer.lines[buffer.count++];
-    line->data = malloc(len + 1);
-    line->capacity = len + 1;
-    memcpy(line->data, data, len);
-    line->data[len] = '\0';  // Null-terminate for safety
-    line->len = len;
-    line->disp_len = 0;  // Compute on demand
+// Pieces and edited lines live in the arena, which free_buffer() empties
+// in one go. `room` bytes are left after the piece for a short line.
+Piece *piece_alloc(size_t room) {
+    size_t capacity;
+    Piece *p = arena_alloc(sizeof(Piece) + room, &capacity);
+    memset(p, 0, sizeof(Piece));
+    p->priority = piece_priority();
+    p->block = capacity >> 4;
+    return p;
 }
 
-void load_file() {
-    init_buffer();
-    char chunk[CHUNK_SIZE];
-    off_t offset = 0;
-    char *line_start = chunk;
-    size_t line_len = 0;
-
-    while (offset < file_size) {
-        ssize_t bytes = pread(fd, chunk, CHUNK_SIZE, offset);
-        if (bytes <= 0) break;
-
-        for (size_t i = 0; i < (size_t)bytes; i++) {
-            if (chunk[i] == '\n' || line_len >= MAX_LINE_SIZE) {
-                add_line(line_start, line_len);
-                line_start = chunk + i + 1;  // Point to the next byte after newline or split
-                line_len = 0;
-                // If we're at the end of the chunk, don't process further here
-                if (i == (size_t)bytes - 1) {
-                    line_start = chunk;  // Reset to start of next chunk
-                    break;
-                }
-            } else {
-                line_len++;
-                // If this is the last byte and no newline, carry over to next chunk
-                if (i == (size_t)bytes - 1 && offset + bytes < file_size) {
-                    // Copy partial line to a temporary buffer if it spans chunks
-                    char *temp = malloc(line_len);
-                    memcpy(temp, line_start, line_len);
-                    offset += bytes;
-                    ssize_t next_bytes = pread(fd, chunk, CHUNK_SIZE, offset);
-                    if (next_bytes > 0) {
-                        size_t temp_len = line_len;
-                        line_start = chunk;
-                        line_len = 0;
-                        memcpy(chunk, temp, temp_len);  // Prepend previous data
-                        line_start = chunk + temp_len;  // Adjust start
-                        bytes = next_bytes;
-                        i = temp_len - 1;  // Continue from where we left off
-                    }
-                    free(temp);
-                }
-            }
+Piece *piece_new(size_t orig, size_t count) {
+    Piece *p = piece_alloc(0);
+    p->orig = orig;
+    p->count = p->lines = count;
+    return p;
+}
+
+static inline int line_inline(Piece *p) {
+    return p->line.data == (char *)(p + 1);
+}
+
+// A piece for the edited line l. A short line is copied in after the
+// piece, so it takes one block next to it, and the storage it had goes.
+Piece *piece_edited(Line *l) {
+    Piece *p = piece_alloc(l->len < LINE_INLINE ? l->len + 1 : 0);
+    p->edited = 1;
+    p->count = p->lines = 1;
+    p->line = *l;
+    if (l->len < LINE_INLINE) {
+        p->line.data = (char *)(p + 1);
+        p->line.capacity = (((size_t)p->block << 4) - sizeof(Piece)) >> 4;
+        memcpy(p->line.data, l->data, l->len);
+        p->line.data[l->len] = '\0';
+        if (l->capacity) arena_release(l->data, (size_t)l->capacity << 4);
+    }
+    return p;
+}
+
+void piece_free(Piece *p) {
+    if (p->edited && p->line.capacity) {
+        columns_forget(p->line.data);
+        if (!line_inline(p)) arena_release(p->line.data, (size_t)p->line.capacity << 4);
+    }
+    arena_release(p, (size_t)p->block << 4);
+}
+
+static inline size_t piece_lines(Piece *p) {
+    return p ? p->lines : 0;
+}
+
+static inline Piece *piece_update(Piece *p) {
+    p->lines = piece_lines(p->left) + p->count + piece_lines(p->right);
+    return p;
+}
+
+Piece *piece_merge(Piece *a, Piece *b) {
+    if (!a) return b;
+    if (!b) return a;
+    if (a->priority > b->priority) {
+        a->right = piece_merge(a->right, b);
+        return piece_update(a);
+    }
+    b->left = piece_merge(a, b->left);
+    return piece_update(b);
+}
+
+// Split p into the first y lines and the rest, cutting a run of file
+// lines in two when y falls inside it
+void piece_split(Piece *p, size_t y, Piece **a, Piece **b) {
+    if (!p) {
+        *a = *b = NULL;
+        return;
+    }
+    size_t left = piece_lines(p->left);
+    if (y <= left) {
+        piece_split(p->left, y, a, &p->left);
+        *b = piece_update(p);
+    } else if (y >= left + p->count) {
+        piece_split(p->right, y - left - p->count, &p->right, b);
+        *a = piece_update(p);
+    } else {
+        size_t head = y - left;
+        Piece *tail = piece_new(p->orig + head, p->count - head);
+        p->count = head;
+        tail->right = p->right;
+        p->right = NULL;
+        *a = piece_update(p);
+        *b = piece_update(tail);
+    }
+}
+
+// Piece holding line y, *k is set to the line within the piece
+Piece *piece_find(size_t y, size_t *k) {
+    Piece *p = buffer.root;
+    while (p) {
+        size_t left = piece_lines(p->left);
+        if (y < left) {
+            p = p->left;
+        } else if (y < left + p->count) {
+            *k = y - left;
+            return p;
+        } else {
+            y -= left + p->count;
+            p = p->right;
+        }
+    }
+    return NULL;
+}
+
+// Take file lines up to `lines` into the buffer, growing the last piece
+// when it is the run of file lines they follow
+void piece_extend(size_t lines) {
+    if (lines <= buffer.file_lines) return;
+    size_t more = lines - buffer.file_lines;
+    Piece *p = buffer.root;
+    while (p && p->right) p = p->right;
+    if (p && !p->edited && p->orig + p->count == buffer.file_lines) {
+        p->count += more;
+        for (p = buffer.root; p; p = p->right) p->lines += more;
+    } else {
+        buffer.root = piece_merge(buffer.root, piece_new(buffer.file_lines, more));
+    }
+    buffer.file_lines = lines;
+}
+
+void free_pieces(Piece *p) {
+    if (!p) return;
+    free_pieces(p->left);
+    free_pieces(p->right);
+    piece_free(p);
+}
+
+// Where file line i starts and how long it is. Lines are mostly read in
+// order, so the end of the last one is remembered to skip the index.
+uint64_t file_line(size_t i, size_t *len) {
+    uint64_t start = i == buffer.next_line ? buffer.next_pos : index_line_start(i);
+    const char *end = seek_newline(file_map + start, map_size - start);
+    *len = end ? (size_t)(end - file_map - start) : map_size - start;
+    buffer.next_line = i + 1;
+    buffer.next_pos = start + *len + 1;
+    return start;
+}
+
+// Long lines keep (byte, column) checkpoints at character boundaries
+// about every COLUMN_STEP bytes, built when first needed, so converting
+// between bytes and columns scans at most one step of the line. The
+// checkpoints of the few lines last used are cached by their address.
+#define COLUMN_LINE (64 << 10)  // Shorter lines are simply scanned
+#define COLUMN_STEP 4096
+#define COLUMN_CACHE 8
+
+typedef struct {
+    size_t byte, col;
+} ColumnMark;
+
+typedef struct {
+    const char *data;   // Line the checkpoints are for
+    size_t len;
+    ColumnMark *marks;
+    size_t count;
+    size_t width;       // Columns in the whole line
+    unsigned long used;
+} Columns;
+
+Columns columns[COLUMN_CACHE];
+unsigned long columns_clock = 0;
+
+// Drop the checkpoints of a line whose text changes or goes away
+void columns_forget(const char *data) {
+    for (int i = 0; i < COLUMN_CACHE; i++) {
+        if (columns[i].data == data) columns[i].data = NULL;
+    }
+}
+
+void columns_reset() {
+    for (int i = 0; i < COLUMN_CACHE; i++) columns[i].data = NULL;
+}
+
+Columns *columns_of(Line *l) {
+    Columns *c = &columns[0];
+    for (int i = 0; i < COLUMN_CACHE; i++) {
+        if (columns[i].data == l->data && columns[i].len == l->len) {
+            columns[i].used = ++columns_clock;
+            return &columns[i];
         }
-        // Handle any remaining data at the end of the chunk
-        if (line_len > 0 && offset + bytes >= file_size) {
-            add_line(line_start, line_len);
-            line_len = 0;
+        if (columns[i].used < c->used) c = &columns[i];
+    }
+    c->data = l->data;
+    c->len = l->len;
+    c->used = ++columns_clock;
+    c->count = 0;
+    c->marks = realloc(c->marks, sizeof(ColumnMark) * (l->len / COLUMN_STEP + 1));
+    size_t byte = 0, col = 0;
+    while (1) {
+        c->marks[c->count++] = (ColumnMark){byte, col};
+        if (byte >= l->len) break;
+        size_t next = byte + COLUMN_STEP;
+        while (next < l->len && (l->data[next] & 0xC0) == 0x80) next++;
+        if (next >= l->len) {
+            col += utf8_display_length(l->data + byte, l->len - byte);
+            break;
         }
-        offset += bytes;
+        col += utf8_display_length(l->data + byte, next - byte);
+        byte = next;
     }
-    if (buffer.count == 0) {
-        add_line("", 0);  // Empty file
+    c->width = col;
+    return c;
+}
+
+// Columns of a short line, and whether it is all ASCII, found once per
+// change of the line so moving over it is not a scan every time
+void line_measure(Line *l) {
+    size_t ascii = utf8_ascii_prefix(l->data, l->len), width = ascii;
+    if (ascii < l->len) width += utf8_display_length(l->data + ascii, l->len - ascii);
+    l->width = width << 2 | LINE_MEASURED | (ascii == l->len ? LINE_ASCII : 0);
+}
+
+// The line's text is about to change
+void line_changed(Line *l) {
+    columns_forget(l->data);
+    l->width = 0;
+}
+
+// Column of byte x in the line
+size_t line_to_display(Line *l, size_t x) {
+    if (l->len < COLUMN_LINE) {
+        if (!l->width) line_measure(l);
+        if (l->width & LINE_ASCII) return x < l->len ? x : l->len;
+        return byte_to_display(l->data, x, l->len);
+    }
+    Columns *c = columns_of(l);
+    size_t lo = 0, hi = c->count;
+    while (hi - lo > 1) {
+        size_t mid = (lo + hi) / 2;
+        if (c->marks[mid].byte <= x) lo = mid;
+        else hi = mid;
     }
+    ColumnMark *m = &c->marks[lo];
+    return m->col + byte_to_display(l->data + m->byte, x - m->byte, l->len - m->byte);
 }
 
-void free_buffer() {
-    for (size_t i = 0; i < buffer.count; i++) {
-        free(buffer.lines[i].data);
+// Byte at column col of the line
+size_t line_to_byte(Line *l, size_t col) {
+    if (l->len < COLUMN_LINE) {
+        // Only a line measured already, the scan is as short as col
+        if (l->width & LINE_ASCII) return col < l->len ? col : l->len;
+        if (l->width && col >= l->width >> 2) return l->len;
+        return display_to_byte(l->data, col, l->len);
+    }
+    if (col == 0) return 0;
+    Columns *c = columns_of(l);
+    size_t lo = 0, hi = c->count;
+    while (hi - lo > 1) {
+        size_t mid = (lo + hi) / 2;
+        if (c->marks[mid].col < col) lo = mid;
+        else hi = mid;
+    }
+    ColumnMark *m = &c->marks[lo];
+    return m->byte + display_to_byte(l->data + m->byte, col - m->col, l->len - m->byte);
+}
+
+// Columns in the whole line
+size_t line_width(Line *l) {
+    if (l->len < COLUMN_LINE) {
+        if (!l->width) line_measure(l);
+        return l->width >> 2;
+    }
+    return columns_of(l)->width;
+}
+
+void line_alloc(Line *l, size_t need) {
+    size_t capacity;
+    l->data = arena_alloc(need, &capacity);
+    l->capacity = capacity >> 4;
+}
+
+// Make the edited line l own storage for at least need bytes. A line
+// outgrowing its piece's block moves to a block of its own. l has to be
+// the line of a piece, from line_edit(), not a view from get_line().
+void line_own(Line *l, size_t need) {
+    assert(l < buffer.views || l >= buffer.views + LINE_VIEWS);
+    Piece *p = (Piece *)((char *)l - offsetof(Piece, line));
+    size_t room = (size_t)l->capacity << 4;
+    if (need < l->len + 1) need = l->len + 1;
+    if (room == 0 || (room < need && line_inline(p))) {
+        char *data = l->data;
+        columns_forget(data);
+        line_alloc(l, room * 2 > need ? room * 2 : need);
+        if (l->len > 0) memcpy(l->data, data, l->len);
+    } else if (room < need) {
+        size_t capacity;
+        columns_forget(l->data);
+        l->data = arena_resize(l->data, room, room * 2 > need ? room * 2 : need, &capacity);
+        l->capacity = capacity >> 4;
+    }
+    l->data[l->len] = '\0';
+}
+
+// Reserve the address space text that grows is kept in, once
+void map_reserve() {
+    if (map_base) return;
+    map_base = mmap(NULL, FOLLOW_RESERVE, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    if (map_base == MAP_FAILED) map_base = NULL;
+}
+
+// Map the first size bytes of the file into file_map. While following, the
+// mapping starts a stretch of reserved address space and grows in place,
+// so lines borrowed from it stay where they are.
+void map_file(off_t size) {
+    file_map = NULL;
+    map_size = 0;
+    map_copy = 0;
+    if (follow || streaming) map_reserve();
+    if (map_base && (size_t)size <= FOLLOW_RESERVE) {
+        // Compressed text seek.c fills in is mapped there already
+        if (size > 0 && !seeking && mmap(map_base, size, PROT_READ, MAP_PRIVATE | MAP_FIXED, fd, 0) == MAP_FAILED) size = 0;
+        file_map = map_base;
+        map_size = size;
+        return;
+    }
+    if (size <= 0) return;
+    file_map = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (file_map == MAP_FAILED) {
+        // Not mappable, read a private copy and borrow from that instead
+        file_map = malloc(size);
+        map_copy = 1;
+        off_t offset = 0;
+        while (offset < size) {
+            ssize_t bytes = pread(fd, file_map + offset, size - offset, offset);
+            if (bytes <= 0) break;
+            offset += bytes;
+        }
+        size = offset;
     }
-    free(buffer.lines);
-    buffer.lines = NULL;
-    buffer.count = buffer.capacity = 0;
+    map_size = size;
+}
+
+// Let go of a mapping from map_file(). The reserved space is kept, with
+// the file's pages dropped from it.
+void unmap_file(char *map, size_t size, int copy) {
+    if (copy) free(map);
+    else if (map && map == map_base) mmap(map_base, size, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE | MAP_FIXED, -1, 0);
+    else if (map) munmap(map, size);
+}
+
+void load_file() {
+    init_buffer();
+    map_file(file_size);
+    file_size = map_size;
+    if (file_size > 0) seek_need(file_map + file_size - 1, 1);  // Read here and by index_lines()
+    trailing_newline = file_size > 0 && file_map[file_size - 1] == '\n';
+    // The first screen is indexed now, the rest in the background. Standard
+    // input has no file to cache the index for, and the text of a compressed
+    // file has one only when it is there at once.
+    index_start(streaming && !seeking ? NULL : filename, seeking, file_map, map_size, rows);
+}
+
+// Lines in the buffer plus those indexed but not pulled in yet
+size_t line_count() {
+    return piece_lines(buffer.root) + index_lines() - buffer.file_lines;
+}
+
+// Line y, waiting for the background index when y is past what it has
+// found so far. Untouched lines are views into file_map kept in a ring of
+// LINE_VIEWS, valid until as many more calls; use line_edit() to change a
+// line.
+Line *get_line(size_t y) {
+    if (y >= piece_lines(buffer.root)) {
+        piece_extend(index_wait(buffer.file_lines + y - piece_lines(buffer.root) + 1));
+        if (y >= piece_lines(buffer.root)) return NULL;
+    }
+    size_t k;
+    Piece *p = piece_find(y, &k);
+    if (p->edited) return &p->line;
+    Line *l = &buffer.views[buffer.view++ % LINE_VIEWS];
+    l->capacity = 0;
+    l->width = 0;
+    if (file_map) {
+        l->data = file_map + file_line(p->orig + k, &l->len);
+    } else {
+        l->data = "";  // Empty file
+        l->len = 0;
+    }
+    return l;
+}
+
+// Line y as a piece of its own that can be changed in place, the pointer
+// stays valid until the line is deleted
+Line *line_edit(size_t y) {
+    text_version++;
+    Line *l = get_line(y);
+    size_t k;
+    Piece *p = piece_find(y, &k);
+    if (p->edited) return l;
+    Piece *a, *b, *c;
+    piece_split(buffer.root, y, &a, &b);
+    piece_split(b, 1, &b, &c);
+    piece_free(b);
+    b = piece_edited(l);
+    buffer.root = piece_merge(piece_merge(a, b), c);
+    return &b->line;
+}
+
+// Insert l as line y, the line's storage goes to the text
+void line_insert(size_t y, Line l) {
+    text_version++;
+    Piece *a, *b, *p = piece_edited(&l);
+    piece_split(buffer.root, y, &a, &b);
+    buffer.root = piece_merge(piece_merge(a, p), b);
+}
+
+void line_delete(size_t y) {
+    text_version++;
+    Piece *a, *b, *c;
+    get_line(y);
+    piece_split(buffer.root, y, &a, &b);
+    piece_split(b, 1, &b, &c);
+    free_pieces(b);
+    buffer.root = piece_merge(a, c);
+}
+
+// Rows of the view: every line of the text or, while filtering, the lines
+// the filter has matched so far. cursor_y and scroll_y count these rows.
+size_t view_lines() {
+    return filtering ? search_hit_count() : line_count();
+}
+
+// Row y of the view, NULL past the end. A filtered row is the line as the
+// search saw it, so far lines show up without waiting for the index.
+Line *view_line(size_t y) {
+    if (!filtering) return get_line(y);
+    if (y >= search_hit_count()) return NULL;
+    SearchHit *h = search_hit(y);
+    Line *l = &buffer.views[buffer.view++ % LINE_VIEWS];
+    l->data = (char *)h->data;
+    l->len = h->len;
+    l->capacity = 0;
+    l->width = 0;
+    return l;
+}
+
+void free_buffer() {
+    index_save_cache();
+    index_free();
+    arena_free();
+    init_buffer();
+    columns_reset();
+    unmap_file(file_map, map_size, map_copy);
+    file_map = NULL;
+    map_size = 0;
 }
 
 // Terminal handling
@@ -187,7 +665,10 @@ void enable_raw_mode() {
     tcgetattr(STDIN_FILENO, &orig_termios);
     struct termios raw = orig_termios;
     raw.c_lflag &= ~(ICANON | ECHO | IEXTEN);
-    raw.c_iflag &= ~(IXON);
+    raw.c_iflag &= ~(IXON | ICRNL);  // Enter comes as \r, pasted line ends as they are
+#ifdef VDSUSP
+    raw.c_cc[VDSUSP] = _POSIX_VDISABLE;  // Ctrl+Y is redo, not a delayed suspend
+#endif
     raw.c_cc[VMIN] = 1;
     raw.c_cc[VTIME] = 0;
     tcsetattr(STDIN_FILENO, TCSAFLUSH, &raw);
@@ -205,82 +686,205 @@ int get_window_size(int *r, int *c) {
     return 0;
 }
 
-void handle_resize(int sig) {
-    resize_flag = 1;
+// Take the new size of the terminal, keeping the cursor on screen
+void handle_resize() {
+    get_window_size(&rows, &cols);
+    screen_resize(rows, cols);
+    if (cursor_y >= (size_t)(rows - 2)) cursor_y = rows - 3;
+    if (scroll_y > view_lines()) scroll_y = view_lines() > 0 ? view_lines() - 1 : 0;
+    resize_flag = 0;
+}
+
+// Keys are decoded from a buffer that one read() fills with all the
+// terminal has sent, so a burst of auto-repeat costs one system call and
+// the main loop can see that more keys are waiting
+unsigned char input_buf[INPUT_BUFFER];
+size_t input_start = 0, input_end = 0;
+
+// Wait up to ms milliseconds (-1 for ever) for input. A resize on the way
+// is left for the main loop, posts from the threads are let go: whoever
+// waits for those looks at the work itself.
+int input_wait(int ms) {
+    struct timespec start, now;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for (int left = ms;;) {
+        int events = event_wait(left, NULL, 0);
+        if (events & EVENT_RESIZE) resize_flag = 1;
+        if (events & EVENT_KEY) return 1;
+        if (ms < 0) continue;
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        left = ms - (int)((now.tv_sec - start.tv_sec) * 1000 + (now.tv_nsec - start.tv_nsec) / 1000000);
+        if (left <= 0) return 0;
+    }
+}
+
+// Next byte of input, waiting up to ms milliseconds (-1 for ever) for it
+// to arrive, -1 if none did
+int input_byte(int ms) {
+    if (input_start == input_end) {
+        if (!input_wait(ms)) return -1;
+        ssize_t n = read(STDIN_FILENO, input_buf, sizeof(input_buf));
+        if (n <= 0) return -1;
+        input_start = 0;
+        input_end = n;
+    }
+    return input_buf[input_start++];
+}
+
+// Wait up to ms milliseconds for a key
+int input_pending(int ms) {
+    return input_start < input_end || input_wait(ms);
+}
+
+// Bracketed paste: the terminal sends pasted text between \033[200~ and
+// \033[201~, and it is taken in here as one block rather than as keys.
+// Carriage returns become newlines, other control bytes are dropped.
+char *paste_buf = NULL;
+size_t paste_len = 0, paste_capacity = 0;
+
+void paste_add(int c, int *cr) {
+    int after_cr = *cr;
+    *cr = c == '\r';
+    if (c == '\n' && after_cr) return;
+    if (c == '\r') c = '\n';
+    if ((c < 32 && c != '\n' && c != '\t') || c == 127) return;
+    if (paste_len == paste_capacity) {
+        paste_capacity = paste_capacity ? paste_capacity * 2 : INPUT_BUFFER;
+        paste_buf = realloc(paste_buf, paste_capacity);
+    }
+    paste_buf[paste_len++] = c;
+}
+
+// Read the pasted text up to the sequence that ends it, returns KEY_PASTE
+int paste_read() {
+    static const char end[] = "\x1b[201~";
+    size_t matched = 0;
+    int cr = 0;
+    paste_len = 0;
+    while (matched < sizeof(end) - 1) {
+        int c = input_byte(PASTE_WAIT);
+        if (c == -1) break;  // The end never came
+        if (c == end[matched]) {
+            matched++;
+            continue;
+        }
+        // Not the end after all, the ESC it started with goes anyway
+        for (size_t i = 1; i < matched; i++) paste_add(end[i], &cr);
+        matched = c == 27;
+        if (!matched) paste_add(c, &cr);
+    }
+    return KEY_PASTE;
 }
 
+// A key, the rest of an escape sequence is only waited for ESC_WAIT
+// milliseconds so ESC on its own is a key too
 int get_input() {
-    int c = getchar();
+    int c = input_byte(-1);
     if (c == 27) {
-        int c2 = getchar();
+        int c2 = input_byte(ESC_WAIT);
         if (c2 == '[') {
-            int c3 = getchar();
+            int c3 = input_byte(ESC_WAIT);
             if (c3 == 'A') return KEY_UP;
             if (c3 == 'B') return KEY_DOWN;
             if (c3 == 'C') return KEY_RIGHT;
             if (c3 == 'D') return KEY_LEFT;
             if (c3 == 'H') return KEY_HOME;
             if (c3 == 'F') return KEY_END;
-            if (c3 == '3' && getchar() == '~') return KEY_DELETE;
-            if (c3 == '5' && getchar() == '~') return KEY_PGUP;
-            if (c3 == '6' && getchar() == '~') return KEY_PGDOWN;
+            if (c3 == '3' && input_byte(ESC_WAIT) == '~') return KEY_DELETE;
+            if (c3 == '5' && input_byte(ESC_WAIT) == '~') return KEY_PGUP;
+            if (c3 == '6' && input_byte(ESC_WAIT) == '~') return KEY_PGDOWN;
             if (c3 >= '1' && c3 <= '2') {
-                int c4 = getchar();
+                int c4 = input_byte(ESC_WAIT);
                 if (c3 == '1') {
-                    if (c4 == '1') { getchar(); return KEY_F1; }  // F1: \033[11~
-                    if (c4 == '2') { getchar(); return KEY_F2; }  // F2: \033[12~
-                    if (c4 == '3') { getchar(); return KEY_F3; }  // F3: \033[13~
-                    if (c4 == '4') { getchar(); return KEY_F4; }  // F4: \033[14~
-                    if (c4 == '5') { getchar(); return KEY_F5; }  // F5: \033[15~
-                    if (c4 == '7') { getchar(); return KEY_F6; }  // F6: \033[17~
-                    if (c4 == '8') { getchar(); return KEY_F7; }  // F7: \033[18~
-                    if (c4 == '9') { getchar(); return KEY_F8; }  // F8: \033[19~
+                    if (c4 == '1') { input_byte(ESC_WAIT); return KEY_F1; }  // F1: \033[11~
+                    if (c4 == '2') { input_byte(ESC_WAIT); return KEY_F2; }  // F2: \033[12~
+                    if (c4 == '3') { input_byte(ESC_WAIT); return KEY_F3; }  // F3: \033[13~
+                    if (c4 == '4') { input_byte(ESC_WAIT); return KEY_F4; }  // F4: \033[14~
+                    if (c4 == '5') { input_byte(ESC_WAIT); return KEY_F5; }  // F5: \033[15~
+                    if (c4 == '7') { input_byte(ESC_WAIT); return KEY_F6; }  // F6: \033[17~
+                    if (c4 == '8') { input_byte(ESC_WAIT); return KEY_F7; }  // F7: \033[18~
+                    if (c4 == '9') { input_byte(ESC_WAIT); return KEY_F8; }  // F8: \033[19~
                     if (c4 == ';') {
-                        int c5 = getchar();
+                        int c5 = input_byte(ESC_WAIT);
                         if (c5 == '5') {
-                           int c6 = getchar();
+                           int c6 = input_byte(ESC_WAIT);
                            if (c6 == 'D') return KEY_CTRL_LEFT;
                            if (c6 == 'C') return KEY_CTRL_RIGHT;
+                           if (c6 == 'H') return KEY_CTRL_HOME;
+                           if (c6 == 'F') return KEY_CTRL_END;
                         }
                     }
                 } else if (c3 == '2') {
-                    if (c4 == '0') { getchar(); return KEY_F9; }  // F9: \033[20~
-                    if (c4 == '1') { getchar(); return KEY_F10; } // F10: \033[21~
+                    if (c4 == '0') {
+                        if (input_byte(ESC_WAIT) == '0' && input_byte(ESC_WAIT) == '~') return paste_read();  // \033[200~
+                        return KEY_F9;  // F9: \033[20~
+                    }
+                    if (c4 == '1') { input_byte(ESC_WAIT); return KEY_F10; } // F10: \033[21~
                     if (c4 == '~') { return KEY_INSERT; } // F10: \033[21~
                 }
             }
         } else if (c2 == 'O') {
-            int c3 = getchar();
+            int c3 = input_byte(ESC_WAIT);
             if (c3 == 'P') return KEY_F1;
             if (c3 == 'R') return KEY_F3;
             if (c3 == 'S') return KEY_F4;
             if (c3 == 'T') return KEY_F5;
             if (c3 == 'U') return KEY_F10;
-        } else if (c2 == '2' && getchar() == '~') return KEY_INSERT;
+        } else if (c2 == '2' && input_byte(ESC_WAIT) == '~') return KEY_INSERT;
         return KEY_ESC;
-    } else if (c == '\n') return KEY_ENTER;
+    } else if (c == '\r' || c == '\n') return KEY_ENTER;
     else if (c == 127) return KEY_BACKSPACE;
     return c;
 }
 
-// UI drawing
+// UI drawing, into the screen's back buffer; nothing reaches the
+// terminal until screen_flush()
 void draw_header() {
-    printf("\x1b[1;1H\x1b[33;44m▄%s%s TV \x1b[90;106m    [%s]    \x1b[37;46m    %s%s%s%-*s", COLOR_PINK_BG, COLOR_WHITE, filename,
+    char progress[32] = "";
+    char stats[96] = "";
+    if (!index_done()) snprintf(progress, sizeof(progress), "[%d%%]", index_progress());
+    if (searching) snprintf(progress, sizeof(progress), "[search %d%%]", search_progress());
+    char filter[48] = "";
+    if (filtering) {
+        size_t line, col;
+        int wrapped;
+        if (search_poll(&line, &col, &wrapped) == SEARCH_RUNNING) {
+            snprintf(filter, sizeof(filter), "[FILTER %zu][%d%%]", search_hit_count(), search_progress());
+        } else {
+            snprintf(filter, sizeof(filter), "[FILTER %zu]", search_hit_count());
+        }
+    }
+    if (show_stats) {
+        size_t bytes;
+        int writes;
+        screen_stats(&bytes, &writes);
+        // Edited lines and pieces: memory they take, and how much of it is slack
+        size_t blocks, used, reserved;
+        arena_stats(&blocks, &used, &reserved);
+        snprintf(stats, sizeof(stats), "[%zuB/%dw][%zuKB %zuB/blk]", bytes, writes,
+                 reserved >> 10, blocks ? (reserved - used) / blocks : 0);
+    }
+    int col = screen_printf(1, 1, "\x1b[33;44m", "▄");
+    col = screen_printf(1, col, COLOR_PINK_BG COLOR_WHITE, " TV ");
+    col = screen_printf(1, col, "\x1b[90;106m", "    [%s]    ", filename);
+    col = screen_printf(1, col, "\x1b[37;46m", "    %s%s%s%s%s%s%s",
         view_mode ? "[VIEW]" : "[EDIT]",
         view_mode ? "" : (insert_mode ? "[INSERTING]"
-                                      : "[REPLACING]"), 
-        modified ? "[+]" : "", cols - ((int)strlen(filename)), "");
-    printf("\x1b[K");
+                                      : "[REPLACING]"),
+        modified ? "[+]" : "", follow || stream_fd != -1 || inflating ? (follow_pinned ? "[FOLLOW]" : "[follow]") : "",
+        filter, progress, stats);
+    screen_fill(1, col, cols - col + 1, "\x1b[37;46m");
 }
 
 void draw_footer() {
-    printf("\x1b[%d;1H\x1b[37m\x1b[44m "
-           "1\x1b[90;106m Help "
-           "3\x1b[90;106m View "
-           "4\x1b[90;106m Edit "
-           "5\x1b[90;106m Blanks "
-           "10\x1b[90;106m Exit %s", rows, COLOR_RESET);
-    printf("\x1b[K");
+    if (status[0]) {
+        int col = screen_printf(rows, 1, "\x1b[90;106m", " %s", status);
+        screen_fill(rows, col, cols - col + 1, "\x1b[90;106m");
+        return;
+    }
+    int col = screen_printf(rows, 1, "\x1b[37m\x1b[44m", " 1");
+    col = screen_printf(rows, col, "\x1b[90;106m", " Help 3 View 4 Edit 5 Blanks 6 Filter 7 Regex 10 Exit ");
+    screen_fill(rows, col, cols - col + 1, COLOR_RESET);
 }
 
 void draw_menu(int selected) {
@@ -290,114 +894,123 @@ void draw_menu(int selected) {
     int start_row = 2;
     int start_col = (cols - width) / 2;
 
-    printf("\x1b[46m");
     for (int i = 0; i < item_count; i++) {
-        if (i == selected) {
-            printf("\x1b[%d;%dH\x1b[90;47m%-*s", start_row + i, start_col, width - 2, items[i]);
-        } else {
-            printf("\x1b[%d;%dH\x1b[97;46m%-*s", start_row + i, start_col, width - 2, items[i]);
+        screen_printf(start_row + i, start_col, i == selected ? "\x1b[90;47m" : "\x1b[97;46m",
+                      "%-*s", width - 2, items[i]);
+    }
+}
+
+// Next hit of the last search in bytes [at, end) of the line
+int line_hit(Line *l, size_t at, size_t end, size_t *start, size_t *stop) {
+    if (search_regex) {
+        regmatch_t m = {at, end};
+        if (regexec(&search_re, l->data, 1, &m, REG_STARTEND | (at ? REG_NOTBOL : 0))) return 0;
+        if ((size_t)m.rm_so >= end) return 0;
+        *start = m.rm_so;
+        *stop = m.rm_eo > m.rm_so ? (size_t)m.rm_eo : *start + 1;  // Empty matches show as one byte
+        return 1;
+    }
+    size_t n = strlen(search_text);
+    const char *hit = search_find(l->data + at, end - at, search_text, n);
+    if (!hit) return 0;
+    *start = hit - l->data;
+    *stop = *start + n;
+    return 1;
+}
+
+// Draw the line from byte `from` on, with hits of the last search
+// highlighted. Only about the part that fits on screen is searched.
+int draw_hits(int row, Line *l, size_t from) {
+    size_t n = strlen(search_text);
+    if (n == 0) return screen_text(row, 1, l->data + from, l->len - from, cols + 1, COLOR_TEXT);
+    // Hits can start before the screen does and end after it
+    size_t reach = search_regex ? 1024 : n - 1;
+    size_t end = line_to_byte(l, scroll_x + cols) + reach;
+    if (end > l->len) end = l->len;
+    size_t at = from > reach ? from - reach : 0;
+    size_t pos = from, h, e;
+    int col = 1;
+    while (pos < l->len && col <= cols) {
+        int hit = at < end && line_hit(l, at, end, &h, &e);
+        if (!hit) h = l->len;
+        if (h > pos) col = screen_text(row, col, l->data + pos, h - pos, cols + 1, COLOR_TEXT);
+        if (!hit) break;
+        if (e > pos) {
+            if (h < pos) h = pos;
+            col = screen_text(row, col, l->data + h, e - h, cols + 1, COLOR_HIT);
+            pos = e;
         }
+        at = e;
     }
-    printf(COLOR_RESET);
+    return col;
 }
 
 void update_line(int line) {
     int buf_idx = scroll_y + line;
     int screen_row = line + 2;
-    printf("\x1b[%d;1H\x1b[K", screen_row);  // Clear the entire line
-    if (buf_idx >= buffer.count) return;
-
-    Line *l = &buffer.lines[buf_idx];
-    size_t byte_start = display_to_byte(l->data, scroll_x, l->len);
-    size_t disp_len = 0;
-    size_t byte_end = byte_start;
-    while (byte_end < l->len && disp_len < cols) {
-        size_t bytes;
-        uint32_t cp = utf8_to_codepoint(l->data, byte_end, l->len, &bytes);
-        disp_len += utf8_char_width(cp);
-        byte_end += bytes;
-    }
-    if (byte_start < l->len) {
-        printf("\x1b[%d;1H%s%.*s", screen_row, COLOR_TEXT, (int)(byte_end - byte_start), l->data + byte_start);
-    }
-    if (show_blanks && disp_len < cols) {
-        printf("%s%*s%s", COLOR_LIGHT_BLUE, (int)(cols - disp_len), "", COLOR_RESET);
-    } else {
-        printf("%s", COLOR_RESET);
+    if (buf_idx >= view_lines()) {
+        screen_fill(screen_row, 1, cols, COLOR_RESET);
+        return;
     }
+
+    Line *l = view_line(buf_idx);
+    size_t byte_start = line_to_byte(l, scroll_x);
+    int col = 1;
+    if (byte_start < l->len) col = draw_hits(screen_row, l, byte_start);
+    screen_fill(screen_row, col, cols - col + 1, show_blanks ? COLOR_LIGHT_BLUE : COLOR_RESET);
 }
 
 void draw_text() {
-    printf("\x1b[2;1H\x1b[J");  // Clear from cursor to end of screen
     for (int i = 0; i < rows - 2; i++) {
         update_line(i);
-        if (i < rows - 3) printf("\n");  // Avoid extra newline on last line
-    }
-    // Clear cursor trail
-    if (last_cursor_x != (size_t)-1 && last_cursor_y >= 0 && !view_mode) {
-        int old_y = last_cursor_y - scroll_y;
-        if (old_y >= 0 && old_y < rows - 2) {
-            Line *l = &buffer.lines[last_cursor_y];
-            size_t disp_x = byte_to_display(l->data, last_cursor_x, l->len);
-            int x = disp_x - scroll_x;
-            char c = (last_cursor_x < l->len) ? l->data[last_cursor_x] : ' ';
-            if (x >= 0 && x < cols) {
-                printf("\x1b[%d;%dH%s%c%s", old_y + 2, x + 1, COLOR_TEXT, c, COLOR_RESET);
-            }
-        }
     }
 
-    // Draw new cursor
-    if (!view_mode) {
-        Line *l = &buffer.lines[cursor_y];
-        size_t disp_x = byte_to_display(l->data, cursor_x, l->len);
+    // Draw the cursor
+    if (!view_mode && cursor_y < view_lines()) {
+        Line *l = view_line(cursor_y);
+        size_t disp_x = line_to_display(l, cursor_x);
         int x = disp_x - scroll_x;
         int cursor_row = cursor_y - scroll_y + 2;
         if (x >= 0 && x < cols && cursor_row >= 2 && cursor_row <= rows - 1) {
-            size_t bytes;
-            int width;
-            uint32_t cp = get_utf8_char_at(l->data, cursor_x, l->len, &bytes, &width);
-            printf("\x1b[%d;%dH\x1b[7m", cursor_row, x + 1);
-            print_utf8_char(cp);
-            printf("\x1b[0m");
-            if (width > 1) printf("\x1b[%d;%dH", cursor_row, x + width + 1);
-            printf("\x1b[%d;1H", cursor_row);
+            size_t bytes = cursor_x < l->len ? utf8_char_bytes(l->data, cursor_x, l->len) : 0;
+            if (bytes) screen_text(cursor_row, x + 1, l->data + cursor_x, bytes, cols + 1, "\x1b[7m");
+            else screen_text(cursor_row, x + 1, " ", 1, cols + 1, "\x1b[7m");
         }
     }
 
-    last_cursor_x = cursor_x;
-    last_cursor_y = cursor_y;
-    // Ensure cursor is at a safe position after drawing
-    printf("\x1b[%d;1H", rows);
+    // Keep the terminal cursor out of the way
+    screen_cursor(rows, 1);
 }
 
 // Editing functions
 void insert_char(char c) {
     if (view_mode) return;
-    Line *l = &buffer.lines[cursor_y];
+    Line *l = line_edit(cursor_y);
+    line_changed(l);
+    if (cursor_x > l->len) cursor_x = l->len;  // Left past the end by a move from a longer line
     if (c == '\n') {
-        if (buffer.count >= buffer.capacity) grow_buffer();
-        memmove(&buffer.lines[cursor_y + 2], &buffer.lines[cursor_y + 1], 
-                (buffer.count - cursor_y - 1) * sizeof(Line));
-        buffer.count++;
-        Line *new_line = &buffer.lines[cursor_y + 1];
-        size_t tail_len = l->len - cursor_x;
-        new_line->data = malloc(tail_len + 1);
-        new_line->capacity = tail_len + 1;
-        new_line->len = tail_len;
-        if (tail_len > 0) memcpy(new_line->data, l->data + cursor_x, tail_len);
-        new_line->data[tail_len] = '\0';
+        undo_record(cursor_y, cursor_x, NULL, 0, "\n", 1);
+        Line tail = {0};
+        tail.len = l->len - cursor_x;
+        if (l->capacity == 0) {
+            // Splitting a mapped line keeps both halves in the mapping
+            tail.data = l->data + cursor_x;
+        } else {
+            line_alloc(&tail, tail.len + 1);
+            if (tail.len > 0) memcpy(tail.data, l->data + cursor_x, tail.len);
+            tail.data[tail.len] = '\0';
+        }
         l->len = cursor_x;
-        l->data[l->len] = '\0';
+        if (l->capacity) l->data[l->len] = '\0';
+        line_insert(cursor_y + 1, tail);
         cursor_y++;
         cursor_x = 0;
         modified = 1;
         draw_text();
     } else {
-        if (l->len >= l->capacity) {
-            l->capacity = l->capacity ? l->capacity * 2 : 16;
-            l->data = realloc(l->data, l->capacity);
-        }
+        line_own(l, l->len + 2);
+        int over = !insert_mode && cursor_x < l->len;
+        undo_record(cursor_y, cursor_x, l->data + cursor_x, over, &c, 1);
         if (insert_mode) {
             memmove(l->data + cursor_x + 1, l->data + cursor_x, l->len - cursor_x);
             l->data[cursor_x] = c;
@@ -417,47 +1030,373 @@ void insert_char(char c) {
     }
 }
 
+// A piece for a new line holding a copy of data[0..len)
+Piece *piece_copy(const char *data, size_t len) {
+    Line l = {(char *)data, len, 0, 0};
+    if (len >= LINE_INLINE) {
+        line_alloc(&l, len + 1);
+        memcpy(l.data, data, len);
+        l.data[len] = '\0';
+    }
+    return piece_edited(&l);
+}
+
+// Put text in at byte *x of line *y in one go: its first line joins that
+// line, the others become pieces that go into the text with a single
+// split. *y and *x move to the end of it.
+void text_insert(size_t *y, size_t *x, const char *data, size_t len) {
+    if (len == 0) return;
+    Line *l = line_edit(*y);
+    line_changed(l);
+    const char *nl = memchr(data, '\n', len);
+    if (!nl) {
+        line_own(l, l->len + len + 1);
+        memmove(l->data + *x + len, l->data + *x, l->len - *x);
+        memcpy(l->data + *x, data, len);
+        l->len += len;
+        l->data[l->len] = '\0';
+        *x += len;
+        return;
+    }
+    const char *s = nl + 1, *end = data + len, *e;
+    Piece *lines = NULL;
+    size_t count = 1;
+    for (; (e = memchr(s, '\n', end - s)); s = e + 1, count++) lines = piece_merge(lines, piece_copy(s, e - s));
+    // The last line put in takes the rest of the line it went into
+    Line last = {0};
+    size_t tail = l->len - *x;
+    last.len = (end - s) + tail;
+    line_alloc(&last, last.len + 1);
+    memcpy(last.data, s, end - s);
+    memcpy(last.data + (end - s), l->data + *x, tail);
+    last.data[last.len] = '\0';
+    lines = piece_merge(lines, piece_edited(&last));
+    line_own(l, *x + (nl - data) + 1);
+    memcpy(l->data + *x, data, nl - data);
+    l->len = *x + (nl - data);
+    l->data[l->len] = '\0';
+    Piece *a, *b;
+    text_version++;
+    piece_split(buffer.root, *y + 1, &a, &b);
+    buffer.root = piece_merge(piece_merge(a, lines), b);
+    *y += count;
+    *x = end - s;
+}
+
+// Take the len bytes data[0..len) out of the text from byte x of line y,
+// its newlines joining the lines around them. The lines in between go
+// with one split.
+void text_delete(size_t y, size_t x, const char *data, size_t len) {
+    if (len == 0) return;
+    Line *l = line_edit(y);
+    line_changed(l);
+    size_t lines = count_newlines(data, len);
+    if (lines == 0) {
+        line_own(l, 0);
+        memmove(l->data + x, l->data + x + len, l->len - x - len);
+        l->len -= len;
+        l->data[l->len] = '\0';
+        return;
+    }
+    // What is left of the last line joins the first
+    size_t skip = len;
+    while (data[skip - 1] != '\n') skip--;
+    skip = len - skip;
+    Line *last = get_line(y + lines);
+    line_own(l, x + last->len - skip + 1);
+    memcpy(l->data + x, last->data + skip, last->len - skip);
+    l->len = x + last->len - skip;
+    l->data[l->len] = '\0';
+    Piece *a, *b, *c;
+    text_version++;
+    piece_split(buffer.root, y + 1, &a, &b);
+    piece_split(b, lines, &b, &c);
+    free_pieces(b);
+    buffer.root = piece_merge(a, c);
+}
+
+// Insert text at the cursor, as a paste does, as one step of undo. The
+// cursor ends up after it, in view; the caller redraws.
+void insert_text(const char *data, size_t len) {
+    if (view_mode || len == 0) return;
+    Line *l = get_line(cursor_y);
+    if (cursor_x > l->len) cursor_x = l->len;  // Left past the end by a move from a longer line
+    undo_record(cursor_y, cursor_x, NULL, 0, data, len);
+    undo_seal();
+    text_insert(&cursor_y, &cursor_x, data, len);
+    modified = 1;
+    if (cursor_y >= (size_t)(scroll_y + rows - 2)) scroll_y = cursor_y - (rows - 3);
+    size_t disp_x = line_to_display(get_line(cursor_y), cursor_x);
+    if (disp_x < (size_t)scroll_x || disp_x >= (size_t)(scroll_x + cols)) {
+        scroll_x = disp_x > (size_t)cols / 2 ? disp_x - cols / 2 : 0;
+    }
+}
+
+// Take back the edit e, or make it again, and show where it was
+void undo_apply(UndoEdit *e, int redo) {
+    const char *removed = (const char *)(e + 1), *inserted = removed + e->removed;
+    size_t y = e->y, x = e->x;
+    text_delete(y, x, redo ? removed : inserted, redo ? e->removed : e->inserted);
+    text_insert(&y, &x, redo ? inserted : removed, redo ? e->inserted : e->removed);
+    modified = 1;
+    find_show(y, x);
+}
+
 void delete_char() {
     if (view_mode) return;
-    Line *l = &buffer.lines[cursor_y];
+    Line *l = line_edit(cursor_y);
+    line_changed(l);
+    if (cursor_x > l->len) cursor_x = l->len;  // Left past the end by a move from a longer line
     if (cursor_x < l->len) {
+        line_own(l, 0);
         size_t bytes = utf8_char_bytes(l->data, cursor_x, l->len);
+        undo_record(cursor_y, cursor_x, l->data + cursor_x, bytes, NULL, 0);
         memmove(l->data + cursor_x, l->data + cursor_x + bytes, l->len - cursor_x - bytes);
         l->len -= bytes;
         l->data[l->len] = '\0';
         modified = 1;
         update_line(cursor_y - scroll_y);
-    } else if (cursor_y + 1 < buffer.count) {
-        Line *next = &buffer.lines[cursor_y + 1];
-        if (l->len + next->len >= l->capacity) {
-            l->capacity = l->len + next->len + 1;
-            l->data = realloc(l->data, l->capacity);
-        }
+    } else if (get_line(cursor_y + 1)) {
+        undo_record(cursor_y, l->len, "\n", 1, NULL, 0);
+        Line *next = get_line(cursor_y + 1);
+        line_own(l, l->len + next->len + 1);
         memcpy(l->data + l->len, next->data, next->len);
         l->len += next->len;
         l->data[l->len] = '\0';
-        memmove(&buffer.lines[cursor_y + 1], &buffer.lines[cursor_y + 2], 
-                (buffer.count - cursor_y - 2) * sizeof(Line));
-        buffer.count--;
-        free(next->data);
+        line_delete(cursor_y + 1);
         modified = 1;
         draw_text();
     }
 }
 
-void save_file() {
-    if (fd == -1 || view_mode) return;
-    lseek(fd, 0, SEEK_SET);
-    for (size_t i = 0; i < buffer.count; i++) {
-        write(fd, buffer.lines[i].data, buffer.lines[i].len);
-        if (i < buffer.count - 1) write(fd, "\n", 1);
+// The text is saved as runs of bytes: runs of untouched file lines
+// straight from the mapping, edited lines and their newlines. When the
+// runs of file lines have not moved only the edits are written over the
+// file. Otherwise the text goes to a temporary file next to the original
+// with writev(), up to SAVE_IOV runs at a time, and is renamed over the
+// original once it is on disk, so a crash or a full disk leaves either
+// the old file or the new one, never a mix of both.
+#define SAVE_IOV 1024
+
+typedef struct {
+    const char *data;
+    size_t len;
+    size_t line;        // For runs of file lines: the first one
+    size_t newlines;    // and how many newlines the run holds
+} SaveRun;
+
+typedef struct {
+    SaveRun *runs;
+    size_t count, capacity;
+    size_t size;        // Bytes in all runs
+} Save;
+
+void save_run(Save *sv, const char *data, size_t len, size_t line, size_t newlines) {
+    if (len == 0) return;
+    if (sv->count == sv->capacity) {
+        sv->capacity = sv->capacity ? sv->capacity * 2 : 64;
+        sv->runs = realloc(sv->runs, sizeof(SaveRun) * sv->capacity);
+    }
+    sv->runs[sv->count++] = (SaveRun){data, len, line, newlines};
+    sv->size += len;
+}
+
+// Lay out the pieces in order
+void save_layout(Save *sv, Piece *p, size_t *y, size_t count) {
+    if (!p) return;
+    save_layout(sv, p->left, y, count);
+    if (p->edited) {
+        save_run(sv, p->line.data, p->line.len, EDITED, 0);
+        if (*y < count - 1 || trailing_newline) save_run(sv, "\n", 1, EDITED, 1);
+    } else if (file_map) {
+        size_t len, end_line = p->orig + p->count;
+        uint64_t start = file_line(p->orig, &len);
+        uint64_t end = end_line < index_lines() ? index_line_start(end_line) : map_size;
+        size_t newlines = p->count - (end_line == index_lines() && !trailing_newline);
+        save_run(sv, file_map + start, end - start, p->orig, newlines);
+    }
+    *y += p->count;
+    save_layout(sv, p->right, y, count);
+}
+
+// Write all runs to out, picking up where a short write stopped
+int save_writev(Save *sv, int out) {
+    struct iovec iov[SAVE_IOV];
+    size_t next = 0, done = 0;  // First run not fully written, and bytes of it that are
+    while (next < sv->count) {
+        int n = 0;
+        for (size_t i = next; i < sv->count && n < SAVE_IOV; i++, n++) {
+            iov[n].iov_base = (char *)sv->runs[i].data + (i == next ? done : 0);
+            iov[n].iov_len = sv->runs[i].len - (i == next ? done : 0);
+        }
+        ssize_t bytes = writev(out, iov, n);
+        if (bytes < 0 && errno == EINTR) continue;
+        if (bytes <= 0) {
+            if (bytes == 0) errno = EIO;
+            return -1;
+        }
+        done += bytes;
+        while (next < sv->count && done >= sv->runs[next].len) done -= sv->runs[next++].len;
+    }
+    return 0;
+}
+
+int save_write(const char *data, size_t len, off_t pos) {
+    while (len > 0) {
+        ssize_t bytes = pwrite(fd, data, len, pos);
+        if (bytes < 0 && errno == EINTR) continue;
+        if (bytes <= 0) {
+            if (bytes == 0) errno = EIO;
+            return -1;
+        }
+        data += bytes;
+        len -= bytes;
+        pos += bytes;
     }
-    ftruncate(fd, file_size);
+    return 0;
+}
+
+// When every run of file lines is still where it was, as after a typo
+// fixed in place or lines added at the end, only the edited lines in
+// between are written, and those already on disk are skipped. Returns 1
+// when the layout needs the full rewrite, otherwise 0 or -1 as a save.
+int save_in_place(Save *sv, size_t *written) {
+    off_t pos = 0;
+    size_t borrowed = 0;
+    for (size_t i = 0; i < sv->count; i++) {
+        SaveRun *r = &sv->runs[i];
+        if (r->line != EDITED && r->data - file_map != pos) return 1;
+        if (r->line == EDITED && file_map && r->data >= file_map && r->data < file_map + map_size) {
+            borrowed += r->len;
+        }
+        pos += r->len;
+    }
+    // Edited lines still borrowing from the mapping may come from bytes
+    // that an earlier write replaces
+    char *copy = borrowed ? malloc(borrowed) : NULL, *at = copy;
+    for (size_t i = 0; i < sv->count && borrowed; i++) {
+        SaveRun *r = &sv->runs[i];
+        if (r->line == EDITED && r->data >= file_map && r->data < file_map + map_size) {
+            memcpy(at, r->data, r->len);
+            r->data = at;
+            at += r->len;
+        }
+    }
+    int result = 0;
+    pos = 0;
+    *written = 0;
+    for (size_t i = 0; i < sv->count && result == 0; i++) {
+        SaveRun *r = &sv->runs[i];
+        if (r->line == EDITED && (pos + r->len > map_size || memcmp(file_map + pos, r->data, r->len) != 0)) {
+            result = save_write(r->data, r->len, pos);
+            *written += r->len;
+        }
+        pos += r->len;
+    }
+    if (result == 0 && pos != file_size) result = ftruncate(fd, pos);
+    if (result == 0) result = fdatasync(fd);
+    free(copy);
+    return result;
+}
+
+// Write everything to a temporary file and rename it over the original,
+// returns the descriptor of the new file or -1
+int save_atomic(Save *sv) {
+    // A symlink is followed so that the file it points to is replaced
+    char path[PATH_MAX], tmp[PATH_MAX + 16];
+    if (!realpath(filename, path)) snprintf(path, sizeof(path), "%s", filename);
+    char *slash = strrchr(path, '/');
+    if (slash) snprintf(tmp, sizeof(tmp), "%.*s/.%s.XXXXXX", (int)(slash - path), path, slash + 1);
+    else snprintf(tmp, sizeof(tmp), ".%s.XXXXXX", path);
+    int out = mkstemp(tmp);
+    if (out == -1) return -1;
+    // The new file gets the mode of the old one or is not put in its place
+    struct stat st;
+    int failed = fstat(fd, &st) == -1 || fchmod(out, st.st_mode & 07777) == -1;
+    if (!failed) {
+        int owned = fchown(out, st.st_uid, st.st_gid);  // Only root can give a file away, it stays ours otherwise
+        (void)owned;
+    }
+    if (failed || save_writev(sv, out) == -1 || fsync(out) == -1 || rename(tmp, path) == -1) {
+        int error = errno;
+        unlink(tmp);
+        close(out);
+        errno = error;
+        return -1;
+    }
+    // Make the rename itself durable
+    int dir = slash ? (*slash = 0, open(slash == path ? "/" : path, O_RDONLY | O_DIRECTORY))
+                    : open(".", O_RDONLY | O_DIRECTORY);
+    if (dir != -1) {
+        fsync(dir);
+        close(dir);
+    }
+    return out;
+}
+
+// Returns 0 when the file was saved, -1 with the reason in status if not
+int save_file() {
+    if (fd == -1 || view_mode) return 0;
+    filter_off();  // The filtered lines point into the mapping that is replaced
+    // The whole layout has to be known before the file is written
+    index_wait((size_t)-1);
+    get_line(line_count() - 1);
+    Save sv = {0};
+    size_t y = 0;
+    save_layout(&sv, buffer.root, &y, line_count());
+
+    struct timespec start, end;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    size_t written = sv.size;
+    int result = save_in_place(&sv, &written);
+    if (result == 1) {
+        int out = save_atomic(&sv);
+        result = out == -1 ? -1 : 0;
+        if (out != -1) {
+            close(fd);
+            fd = out;
+            if (follow) follow_watch();  // The name is a new file now
+        }
+    }
+    if (result == -1) {
+        snprintf(status, sizeof(status), "Save failed: %s", strerror(errno));
+        free(sv.runs);
+        return -1;
+    }
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    double ms = (end.tv_sec - start.tv_sec) * 1e3 + (end.tv_nsec - start.tv_nsec) / 1e6;
+    snprintf(status, sizeof(status), "Saved %zu lines, %.1f MB written in %.0f ms (%.0f MB/s)",
+             line_count(), written / 1e6, ms, ms > 0 ? written / 1e3 / ms : 0.0);
+
+    // Point the buffer at the new file: every line is untouched again, and
+    // the index is rebuilt from the layout instead of scanning the file
+    file_size = sv.size;
+    char *old_map = file_map;
+    size_t old_size = map_size;
+    int old_copy = map_copy;
+    map_file(file_size);
+    index_rebuild(file_map, map_size);
+    off_t at = 0;
+    for (size_t i = 0; i < sv.count; i++) {
+        SaveRun *r = &sv.runs[i];
+        if (r->line != EDITED) index_append_lines(r->line, r->newlines, at - (r->data - old_map));
+        else if (r->newlines) index_append(at + 1);
+        at += r->len;
+    }
+    index_rebuild_done();
+    free(sv.runs);
+    if (old_map != file_map) unmap_file(old_map, old_size, old_copy);
+
+    arena_free();
+    init_buffer();
+    piece_extend(index_lines());
+    columns_reset();
     modified = 0;
+    return 0;
 }
 
 void move_cursor_word(int direction) {
-    Line *l = &buffer.lines[cursor_y];
+    Line *l = get_line(cursor_y);
     size_t x = cursor_x;
     if (direction < 0) {
         while (x > 0 && isspace(l->data[x - 1])) x--;
@@ -467,7 +1406,7 @@ void move_cursor_word(int direction) {
         while (x < l->len && isspace(l->data[x])) x += utf8_char_bytes(l->data, x, l->len);
     }
     cursor_x = x;
-    size_t disp_x = byte_to_display(l->data, cursor_x, l->len);
+    size_t disp_x = line_to_display(l, cursor_x);
     if (disp_x < scroll_x) {
         scroll_x = disp_x;
         draw_text();
@@ -477,6 +1416,654 @@ void move_cursor_word(int direction) {
     }
 }
 
+// Read a line of input on the footer row, returns 0 when cancelled
+int prompt(const char *label, char *out, size_t size) {
+    size_t len = 0;
+    out[0] = 0;
+    while (1) {
+        int col = screen_printf(rows, 1, "\x1b[37;44m", " %s", label);
+        col = screen_printf(rows, col, "\x1b[90;106m", " %s", out);
+        screen_fill(rows, col, cols - col + 1, "\x1b[90;106m");
+        screen_flush();
+        int c = get_input();
+        if (c == KEY_ENTER) return 1;
+        if (c == KEY_ESC) return 0;
+        if (c == KEY_BACKSPACE && len > 0) out[--len] = 0;
+        else if (c >= 32 && c <= 126 && len + 1 < size) {
+            out[len++] = c;
+            out[len] = 0;
+        } else if (c == KEY_PASTE) {
+            // Its first line, as if typed
+            for (size_t i = 0; i < paste_len && paste_buf[i] != '\n' && len + 1 < size; i++) {
+                if (paste_buf[i] >= 32 && paste_buf[i] <= 126) out[len++] = paste_buf[i];
+            }
+            out[len] = 0;
+        }
+    }
+}
+
+// Jump to line n (1-based), centred on screen. Lines before it are only
+// waited for when the index has not reached it yet.
+void goto_line(size_t n) {
+    if (n == 0) n = 1;
+    if (filtering) {
+        // The first line from n on that the filter matched
+        n = hit_after(search_hit_count(), n - 1, 0, 1) + 1;
+        if (n > view_lines()) n = view_lines() ? view_lines() : 1;
+    } else if (!get_line(n - 1)) {
+        n = line_count();
+    }
+    cursor_y = n - 1;
+    cursor_x = 0;
+    scroll_x = 0;
+    scroll_y = cursor_y > (size_t)(rows - 2) / 2 ? cursor_y - (rows - 2) / 2 : 0;
+    draw_text();
+}
+
+// Search runs on the worker over a snapshot of the text: the pieces laid
+// out as runs of whole lines, the run of file lines holding the line the
+// search starts on split so that one run starts there
+typedef struct {
+    SearchRun *runs;
+    size_t count, capacity;
+    size_t split;       // Line the search starts on
+    size_t start;       // and the run that starts with it
+} Find;
+
+void find_run(Find *f, const char *data, size_t len, size_t line, size_t newlines) {
+    if (f->count == f->capacity) {
+        f->capacity = f->capacity ? f->capacity * 2 : 64;
+        f->runs = realloc(f->runs, sizeof(SearchRun) * f->capacity);
+    }
+    f->runs[f->count++] = (SearchRun){data, len, line, newlines};
+}
+
+// Run of count file lines from line orig, which is line y of the text
+void find_lines(Find *f, size_t orig, size_t count, size_t y) {
+    size_t len, end_line = orig + count;
+    uint64_t start = file_line(orig, &len);
+    uint64_t end = end_line < index_lines() || !index_done() ? index_line_start(end_line) : map_size;
+    find_run(f, file_map + start, end - start, y, count - (end == map_size && !trailing_newline));
+}
+
+void find_layout(Find *f, Piece *p, size_t *y) {
+    if (!p) return;
+    find_layout(f, p->left, y);
+    if (p->edited) {
+        if (*y == f->split) f->start = f->count;
+        find_run(f, p->line.data, p->line.len, *y, 0);
+    } else if (file_map) {
+        size_t k = f->split > *y && f->split < *y + p->count ? f->split - *y : 0;
+        if (k) find_lines(f, p->orig, k, *y);
+        if (*y + k == f->split) f->start = f->count;
+        find_lines(f, p->orig + k, p->count - k, *y + k);
+    }
+    *y += p->count;
+    find_layout(f, p->right, y);
+}
+
+// Put the cursor on byte x of line y and scroll it into view
+void find_show(size_t y, size_t x) {
+    Line *l = get_line(y);
+    cursor_y = y;
+    cursor_x = x;
+    if (y < (size_t)scroll_y || y >= (size_t)(scroll_y + rows - 2)) {
+        scroll_y = y > (size_t)(rows - 2) / 2 ? y - (rows - 2) / 2 : 0;
+    }
+    size_t disp_x = line_to_display(l, x);
+    if (disp_x < (size_t)scroll_x || disp_x >= (size_t)(scroll_x + cols)) {
+        scroll_x = disp_x > (size_t)cols / 2 ? disp_x - cols / 2 : 0;
+    }
+    draw_text();
+}
+
+// The whole text as runs for the worker, with one starting on line y
+Find find_snapshot(size_t y) {
+    Find f = {.split = y};
+    size_t line = 0;
+    find_layout(&f, buffer.root, &line);
+    if (file_map && (buffer.file_lines < index_lines() || !index_done())) {
+        // Lines not pulled into the buffer yet, up to the end of the file
+        uint64_t start = index_line_start(buffer.file_lines);
+        if (y != (size_t)-1 && y > line) {
+            uint64_t split = index_line_start(buffer.file_lines + y - line);
+            find_run(&f, file_map + start, split - start, line, y - line);
+            start = split;
+            line = y;
+        }
+        if (line == y) f.start = f.count;
+        find_run(&f, file_map + start, map_size - start, line, SEARCH_UNKNOWN);
+    }
+    return f;
+}
+
+// Wait for the worker with the screen and the keys live. Returns the
+// search state, or -1 when a key came first, which cancels the search
+// and is left to be read.
+int find_wait() {
+    size_t line, col;
+    int wrapped, state;
+    while ((state = search_poll(&line, &col, &wrapped)) == SEARCH_RUNNING) {
+        // The worker posts when it is done, so this only sleeps out the
+        // whole PROGRESS_MS while it still runs
+        int events = input_start < input_end ? EVENT_KEY : event_wait(PROGRESS_MS, NULL, 0);
+        if (events & EVENT_RESIZE) resize_flag = 1;
+        if (events & EVENT_KEY) {
+            search_cancel();
+            searching = 0;
+            return -1;
+        }
+        // Still going, show how far
+        searching = 1;
+        draw_header();
+        screen_flush();
+    }
+    searching = 0;
+    return state;
+}
+
+// Look for search_text from byte x of line y, forward or backward and
+// wrapping around. Returns 1 when the cursor moved to a hit, 0 when there
+// is none and -1 when a key came first.
+int find(size_t y, size_t x, int backward) {
+    Find f = find_snapshot(y);
+    search_start(f.runs, f.count, f.start, x, search_text, strlen(search_text), backward);
+    int state = find_wait();
+    if (state != SEARCH_FOUND) return state == -1 ? -1 : 0;
+    size_t hit_y, hit_x;
+    int wrapped;
+    search_poll(&hit_y, &hit_x, &wrapped);
+    find_show(hit_y, hit_x);
+    if (wrapped) snprintf(status, sizeof(status), "Search wrapped");
+    return 1;
+}
+
+// List the lines the regular expression in search_text matches, on the
+// thread pool. Returns like find_wait().
+int find_regex() {
+    struct timespec start, end;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    Find f = find_snapshot((size_t)-1);
+    size_t bytes = 0;
+    for (size_t i = 0; i < f.count; i++) bytes += f.runs[i].len;
+    search_start_regex(f.runs, f.count, search_text);
+    int state = find_wait();
+    if (state == -1) return -1;
+    hits_version = text_version;
+    size_t count = state == SEARCH_FOUND ? search_hit_count() : 0;
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    double ms = (end.tv_sec - start.tv_sec) * 1e3 + (end.tv_nsec - start.tv_nsec) / 1e6;
+    if (ms < 0.001) ms = 0.001;
+    char lines[32] = "No";
+    if (count) snprintf(lines, sizeof(lines), "%zu", count);
+    snprintf(status, sizeof(status), "%s lines match, %.1f MB in %.0f ms (%.0f MB/s, %.0f matches/s)",
+             lines, bytes / 1e6, ms, bytes / 1e3 / ms, count * 1e3 / ms);
+    return state;
+}
+
+// First of the first count hits at or after (y, x), or after it when not
+// `inclusive`
+size_t hit_after(size_t count, size_t y, size_t x, int inclusive) {
+    size_t lo = 0, hi = count;
+    while (lo < hi) {
+        size_t mid = lo + (hi - lo) / 2;
+        SearchHit *h = search_hit(mid);
+        if (h->line > y || (h->line == y && (inclusive ? h->col >= x : h->col > x))) hi = mid;
+        else lo = mid + 1;
+    }
+    return lo;
+}
+
+// Move to the next or previous line the regular expression matches, or
+// to the first one from the cursor on when `here`. The list of matching
+// lines is made again once the text has changed.
+void find_regex_next(int backward, int here) {
+    int fresh = hits_version != text_version;
+    if (fresh && find_regex() == -1) return;
+    size_t count = search_hit_count();
+    if (count == 0) {
+        if (!fresh) snprintf(status, sizeof(status), "Not found: %.200s", search_text);
+        return;
+    }
+    size_t i;
+    if (!backward) {
+        i = hit_after(count, cursor_y, cursor_x, here);
+        if (i == count) i = 0;
+    } else {
+        i = hit_after(count, cursor_y, cursor_x, 1);
+        i = i > 0 ? i - 1 : count - 1;
+    }
+    find_show(search_hit(i)->line, search_hit(i)->col);
+    if (!fresh) snprintf(status, sizeof(status), "Match %zu of %zu", i + 1, count);
+}
+
+// Make pattern the last search, compiled into search_re. Returns 0 with
+// the reason in status when it is not a valid regular expression.
+int regex_use(const char *pattern) {
+    regex_t re;
+    int error = regcomp(&re, pattern, REG_EXTENDED | REG_NEWLINE);
+    if (error) {
+        char message[128];
+        regerror(error, &re, message, sizeof(message));
+        snprintf(status, sizeof(status), "Regex: %s", message);
+        return 0;
+    }
+    if (search_regex) regfree(&search_re);
+    search_re = re;
+    search_regex = 1;
+    strcpy(search_text, pattern);
+    hits_version = (unsigned long)-1;
+    return 1;
+}
+
+// Ask for a regular expression on the footer row and go to its first match
+void regex_prompt() {
+    char pattern[sizeof(search_text)];
+    if (!prompt("Regex:", pattern, sizeof(pattern)) || !pattern[0]) return;
+    if (regex_use(pattern)) find_regex_next(0, 1);
+}
+
+// Line the cursor is on in the text, whether filtering or not
+size_t filter_line() {
+    if (!filtering) return cursor_y;
+    return cursor_y < search_hit_count() ? search_hit(cursor_y)->line : filter_origin;
+}
+
+// Show every line again, with the cursor on the line it was on
+void filter_off() {
+    if (!filtering) return;
+    size_t y = filter_line(), x = cursor_y < search_hit_count() ? cursor_x : 0;
+    size_t line, col;
+    int wrapped;
+    if (search_poll(&line, &col, &wrapped) == SEARCH_RUNNING) {
+        search_cancel();  // Ctrl+N has no use for part of the list
+        hits_version = (unsigned long)-1;
+    }
+    filtering = 0;
+    find_show(y, x);
+}
+
+// The text has grown since the filter took its snapshot: search on from
+// the line its last round ended on and add the lines that match. Called
+// again once the round that is still running is done.
+void filter_more() {
+    size_t line, col;
+    int wrapped;
+    if (!filtering || map_size == filter_size || search_poll(&line, &col, &wrapped) == SEARCH_RUNNING) return;
+    size_t from = search_end_line(), first = 0;
+    Find f = find_snapshot(from);
+    while (first < f.count && f.runs[first].line < from) first++;
+    memmove(f.runs, f.runs + first, sizeof(SearchRun) * (f.count - first));
+    filter_size = map_size;
+    search_more_regex(f.runs, f.count - first, from);
+}
+
+// Ask for a regular expression on the footer row and show only the lines
+// it matches, an empty one shows them all again. The matching lines are
+// listed on the thread pool and the view grows as they come in.
+void filter_prompt() {
+    char pattern[sizeof(search_text)];
+    if (!prompt("Filter:", pattern, sizeof(pattern))) return;
+    if (!pattern[0]) {
+        filter_off();
+        return;
+    }
+    if (!regex_use(pattern)) return;
+    filter_origin = filter_line();
+    Find f = find_snapshot((size_t)-1);
+    search_start_regex(f.runs, f.count, search_text);
+    hits_version = text_version;
+    filter_size = map_size;
+    filtering = 1;
+    cursor_x = cursor_y = 0;
+    scroll_x = scroll_y = 0;
+    draw_text();
+}
+
+void find_next(int backward) {
+    if (find(cursor_y, backward ? cursor_x : cursor_x + 1, backward) == 0) {
+        snprintf(status, sizeof(status), "Not found: %.200s", search_text);
+    }
+}
+
+// Incremental search on the footer row. Every key starts the search over
+// and cancels the one still running. Ctrl+F (or Ctrl+N) and Ctrl+R (or
+// Ctrl+P) step to the next and the previous hit, Enter stays there and
+// Esc goes back.
+void find_prompt(int backward) {
+    if (search_regex) regfree(&search_re);
+    search_regex = 0;
+    size_t origin_y = cursor_y, origin_x = cursor_x;
+    int origin_scroll_y = scroll_y, origin_scroll_x = scroll_x;
+    size_t len = 0;
+    search_text[0] = 0;
+    status[0] = 0;
+    while (1) {
+        draw_header();
+        draw_text();
+        int col = screen_printf(rows, 1, "\x1b[37;44m", " %s", backward ? "Search back:" : "Search:");
+        col = screen_printf(rows, col, "\x1b[90;106m", " %s", search_text);
+        if (status[0]) col = screen_printf(rows, col, "\x1b[90;106m", "  [%s]", status);
+        screen_fill(rows, col, cols - col + 1, "\x1b[90;106m");
+        screen_flush();
+        int c = get_input();
+        status[0] = 0;
+        size_t y = cursor_y, x;
+        if (c == KEY_ENTER) break;
+        if (c == KEY_ESC) {
+            search_text[0] = 0;
+            cursor_y = origin_y;
+            cursor_x = origin_x;
+            scroll_y = origin_scroll_y;
+            scroll_x = origin_scroll_x;
+            break;
+        }
+        if (c == KEY_CTRL_F || c == KEY_CTRL_R || c == KEY_CTRL_N || c == KEY_CTRL_P) {
+            // The next hit, past the one the cursor is on
+            backward = c == KEY_CTRL_R || c == KEY_CTRL_P;
+            x = backward ? cursor_x : cursor_x + 1;
+        } else if (c == KEY_BACKSPACE) {
+            if (len == 0) continue;
+            search_text[--len] = 0;
+            y = cursor_y = origin_y;
+            cursor_x = origin_x;
+            scroll_y = origin_scroll_y;
+            scroll_x = origin_scroll_x;
+            x = backward ? origin_x + 1 : origin_x;
+        } else if (((c >= 32 && c <= 126) || (c >= 128 && c <= 255)) && len + 1 < sizeof(search_text)) {
+            // A longer text can still match where the cursor is
+            search_text[len++] = c;
+            search_text[len] = 0;
+            x = backward ? cursor_x + 1 : cursor_x;
+        } else if (c == KEY_PASTE && paste_len > 0 && paste_buf[0] != '\n') {
+            // The first line of it, searched for once
+            for (size_t i = 0; i < paste_len && paste_buf[i] != '\n' && len + 1 < sizeof(search_text); i++) {
+                search_text[len++] = paste_buf[i];
+            }
+            search_text[len] = 0;
+            x = backward ? cursor_x + 1 : cursor_x;
+        } else {
+            continue;
+        }
+        if (len > 0 && find(y, x, backward) == 0) snprintf(status, sizeof(status), "not found");
+    }
+    status[0] = 0;
+    draw_text();
+}
+
+// Follow mode: the file is watched with inotify (or looked at with stat()
+// where there is none) while the editor waits for keys. Appended bytes are
+// mapped and indexed on their own and their lines join the buffer; a file
+// that shrank or was replaced by a new one under its name is loaded again.
+void follow_watch() {
+#ifdef __linux__
+    if (follow_fd == -1) {
+        follow_fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+        if (follow_fd == -1) return;
+    }
+    if (follow_wd != -1) inotify_rm_watch(follow_fd, follow_wd);
+    follow_wd = inotify_add_watch(follow_fd, filename, IN_MODIFY | IN_ATTRIB | IN_MOVE_SELF | IN_DELETE_SELF);
+#endif
+    follow_moved = 0;
+}
+
+// Keep the last line at the bottom of the screen
+void follow_end() {
+    size_t count = line_count();
+    int top = count > (size_t)(rows - 2) ? count - (rows - 2) : 0;
+    if (filtering || scroll_y == top) return;
+    scroll_y = top;
+    if (cursor_y < (size_t)scroll_y) cursor_y = scroll_y;
+    draw_text();
+}
+
+// Read the file again from the start, keeping the view where it was
+void follow_reload() {
+    int new_fd = open(filename, O_RDWR);
+    if (new_fd == -1) new_fd = open(filename, O_RDONLY);
+    struct stat st;
+    if (new_fd == -1 || fstat(new_fd, &st) != 0) {
+        if (new_fd != -1) close(new_fd);
+        return;
+    }
+    filter_off();
+    search_cancel();
+    hits_version = (unsigned long)-1;
+    text_version++;
+    index_drop_cache();  // Truncated or rotated, what was indexed is not the file any more
+    free_buffer();
+    undo_free();  // Another text, the edits no longer apply
+    close(fd);
+    fd = new_fd;
+    modified = 0;
+    file_size = st.st_size;
+    load_file();
+    follow_watch();
+    size_t count = line_count();
+    if (cursor_y >= count) cursor_y = count ? count - 1 : 0;
+    if ((size_t)scroll_y > cursor_y) scroll_y = cursor_y;
+    cursor_x = 0;
+    draw_text();
+}
+
+// The text runs on to size bytes of file_map, index the rest
+void text_grow(size_t size) {
+    map_size = file_size = size;
+    trailing_newline = file_map[map_size - 1] == '\n';
+    // The last line may go on in the new bytes, so the next one moved
+    buffer.next_line = buffer.next_pos = 0;
+    text_version++;
+    index_grow(file_map, map_size);
+    filter_more();
+}
+
+// Map and index what was appended since the last look
+void follow_grow(off_t size) {
+    size_t from = map_size / sysconf(_SC_PAGESIZE) * sysconf(_SC_PAGESIZE);
+    if (map_copy || !map_base || (size_t)size > FOLLOW_RESERVE ||
+        mmap(map_base + from, size - from, PROT_READ, MAP_PRIVATE | MAP_FIXED, fd, from) == MAP_FAILED) {
+        follow_reload();  // The mapping cannot grow where it is
+        return;
+    }
+    file_map = map_base;
+    text_grow(size);
+}
+
+// Take in changes to the file, without waiting for any
+void follow_update() {
+    int changed = follow_fd == -1;
+#ifdef __linux__
+    char events[4096] __attribute__((aligned(__alignof__(struct inotify_event))));
+    ssize_t n;
+    while (follow_fd != -1 && (n = read(follow_fd, events, sizeof(events))) > 0) {
+        for (char *p = events; p < events + n; p += sizeof(struct inotify_event) + ((struct inotify_event *)p)->len) {
+            struct inotify_event *e = (struct inotify_event *)p;
+            if (e->mask & (IN_MOVE_SELF | IN_DELETE_SELF | IN_IGNORED)) follow_moved = 1;
+            changed = 1;
+        }
+    }
+#endif
+    if (follow_moved || follow_fd == -1) {
+        // Rotated: go over to the new file once one shows up under the name
+        struct stat now, st;
+        if (stat(filename, &now) == 0 && fstat(fd, &st) == 0 &&
+            (now.st_ino != st.st_ino || now.st_dev != st.st_dev)) {
+            if (modified) {
+                snprintf(status, sizeof(status), "%.200s was replaced, not reloaded over changes", filename);
+            } else {
+                follow_reload();
+                return;
+            }
+        }
+    }
+    struct stat st;
+    if (!changed || fstat(fd, &st) != 0) return;
+    if ((size_t)st.st_size > map_size) {
+        follow_grow(st.st_size);
+    } else if ((size_t)st.st_size < map_size) {
+        // The lines past the new end cannot be read any more, changes or not
+        int dropped = modified;
+        follow_reload();
+        if (dropped) snprintf(status, sizeof(status), "%.200s was truncated, changes are lost", filename);
+    }
+}
+
+// Standard input is read into the reserved space at map_base as it comes:
+// anonymous memory for the first STREAM_MEMORY bytes, then an unlinked
+// file that is mapped right after it, so the text stays one stretch of
+// memory however long the stream is and only its head has to fit in RAM.
+// Keys are read from the terminal instead.
+int stream_open() {
+    if (isatty(STDIN_FILENO)) return -1;
+    stream_fd = dup(STDIN_FILENO);
+    int tty = open("/dev/tty", O_RDWR);
+    if (stream_fd == -1 || tty == -1 || dup2(tty, STDIN_FILENO) == -1) return -1;
+    close(tty);
+    fcntl(stream_fd, F_SETFL, O_NONBLOCK);
+    streaming = 1;
+    return 0;
+}
+
+// Make sure at least need bytes are mapped to read into
+int stream_grow(size_t need) {
+    if (!map_base || need > FOLLOW_RESERVE) return -1;
+    if (stream_room == 0) {
+        if (mmap(map_base, STREAM_MEMORY, PROT_READ | PROT_WRITE,
+                 MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE | MAP_FIXED, -1, 0) == MAP_FAILED) return -1;
+        stream_room = STREAM_MEMORY;
+    }
+    while (stream_room < need) {
+        if (stream_spill == -1 && (stream_spill = spill_open()) == -1) return -1;
+        off_t at = stream_room - STREAM_MEMORY;
+        if (ftruncate(stream_spill, at + STREAM_SPILL) != 0 ||
+            mmap(map_base + stream_room, STREAM_SPILL, PROT_READ | PROT_WRITE,
+                 MAP_SHARED | MAP_FIXED, stream_spill, at) == MAP_FAILED) return -1;
+        stream_room += STREAM_SPILL;
+    }
+    return 0;
+}
+
+void stream_close() {
+    close(stream_fd);
+    stream_fd = -1;
+    int result;
+    if (stream_pid == -1 || waitpid(stream_pid, &result, 0) != stream_pid) return;
+    stream_pid = -1;
+    if (WIFEXITED(result) && WEXITSTATUS(result) == 127) {
+        snprintf(status, sizeof(status), "%s is needed to read %.200s", stream_tool, filename);
+    } else if (!WIFEXITED(result) || WEXITSTATUS(result) != 0) {
+        snprintf(status, sizeof(status), "%s could not read all of %.200s", stream_tool, filename);
+    }
+}
+
+// zstd and xz files are read through their own tools, from a pipe like
+// standard input
+int stream_command(const char *tool) {
+    int pipe_fds[2];
+    if (pipe(pipe_fds) != 0) return -1;
+    stream_pid = fork();
+    if (stream_pid == 0) {
+        int null = open("/dev/null", O_WRONLY);
+        dup2(fd, STDIN_FILENO);
+        dup2(pipe_fds[1], STDOUT_FILENO);
+        if (null != -1) dup2(null, STDERR_FILENO);
+        close(pipe_fds[0]);
+        execlp(tool, tool, "-dc", (char *)NULL);
+        _exit(127);
+    }
+    close(pipe_fds[1]);
+    if (stream_pid == -1) {
+        close(pipe_fds[0]);
+        return -1;
+    }
+    stream_fd = pipe_fds[0];
+    stream_tool = tool;
+    fcntl(stream_fd, F_SETFL, O_NONBLOCK);
+    return 0;
+}
+
+// gzip files are decompressed by gzip.c into the reserved space, the same
+// way standard input is read into it, on a thread of its own. It keeps
+// checkpoints of the file in the cache for the next time it is opened;
+// with them the text is there at once at its full size, and is
+// decompressed from the checkpoint before wherever it is read.
+int gzip_open() {
+    zip_map = mmap(NULL, file_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (zip_map == MAP_FAILED) {
+        zip_map = NULL;
+        return -1;
+    }
+    zip_size = file_size;
+    size_t size = gzip_index(filename, zip_map, zip_size);
+    if (size > 0 && size <= FOLLOW_RESERVE) {
+        map_reserve();
+        seeking = map_base && gzip_seek(map_base) == 0;
+    }
+    inflating = !seeking;
+    if (seeking) file_size = size;
+    return 0;
+}
+
+// Compressed files are shown as the text they hold, read only
+void compressed_open() {
+    char magic[6];
+    if (pread(fd, magic, sizeof(magic), 0) != sizeof(magic)) return;
+    int opened;
+    if (gzip_detect(magic, sizeof(magic))) opened = gzip_open();
+    else if (memcmp(magic, "\x28\xb5\x2f\xfd", 4) == 0) opened = stream_command("zstd");
+    else if (memcmp(magic, "\xfd" "7zXZ", 6) == 0) opened = stream_command("xz");
+    else return;
+    if (opened == -1) return;
+    compressed = streaming = 1;
+    view_mode = 1;
+    if (!seeking) file_size = 0;
+}
+
+// Take in what gzip.c has decompressed since the last round
+void gzip_update() {
+    size_t size = gzip_size(), at;
+    int state = gzip_state(&at);
+    if (size > map_size) {
+        file_map = map_base;
+        text_grow(size);
+    }
+    if (state == 0 || size != gzip_size()) return;
+    inflating = 0;
+    if (state == -1) snprintf(status, sizeof(status), "%.200s is damaged at byte %zu, shown up to there", filename, at);
+}
+
+// Once seek.c has filled in all of the text, say if some of it could not be
+void seek_update() {
+    size_t at;
+    int state = seek_state(&at);
+    if (state == 0) return;
+    seeking = 2;
+    if (state == -1) snprintf(status, sizeof(status), "%.200s is damaged at byte %zu, the text from there may be wrong", filename, at);
+}
+
+// Read what the pipe has, up to STREAM_ROUND bytes, without waiting
+void stream_update() {
+    size_t size = map_size;
+    while (stream_fd != -1 && size - map_size < STREAM_ROUND) {
+        if (stream_grow(size + 1) == -1) {
+            snprintf(status, sizeof(status), "Input stopped at %.1f MB: %s", size / 1e6, strerror(errno));
+            stream_close();
+            break;
+        }
+        ssize_t n = read(stream_fd, map_base + size, stream_room - size);
+        if (n < 0 && errno == EINTR) continue;
+        if (n < 0 && errno == EAGAIN) break;
+        if (n <= 0) {
+            stream_close();
+            break;
+        }
+        size += n;
+    }
+    if (size == map_size) return;
+    file_map = map_base;
+    text_grow(size);
+}
+
 // Menu handling
 int handle_menu() {
     int selected = 0;
@@ -484,11 +2071,12 @@ int handle_menu() {
         draw_header();
         draw_text();
         draw_menu(selected);
+        screen_flush();
         int c = get_input();
         if (c == KEY_UP && selected > 0) selected--;
         else if (c == KEY_DOWN && selected < 2) selected++;
         else if (c == KEY_ENTER) {
-            if (selected == 0) view_mode = 0;
+            if (selected == 0) view_mode = streaming;
             else if (selected == 1) save_file();
             else if (selected == 2) return 1;
             break;
@@ -498,8 +2086,14 @@ int handle_menu() {
 }
 
 int main(int argc, char *argv[]) {
+    if (argc == 3 && strcmp(argv[1], "-f") == 0) {
+        follow = follow_pinned = 1;
+        view_mode = 1;
+        argv++;
+        argc--;
+    }
     if (argc != 2) {
-        printf("Usage: tv <filename>\n");
+        printf("Usage: tv [-f] <filename>\n       command | tv -\n");
         return 1;
     }
 
@@ -507,41 +2101,113 @@ int main(int argc, char *argv[]) {
     filename[sizeof(filename) - 1] = 0;
 
     struct stat st;
-    if (stat(filename, &st) == 0) {
+    if (strcmp(filename, "-") == 0) {
+        if (follow || stream_open() == -1) {
+            fprintf(stderr, "tv: - reads a pipe, with keys from the terminal\n");
+            return 1;
+        }
+        view_mode = 1;
+        file_size = 0;
+    } else if (stat(filename, &st) == 0) {
         file_size = st.st_size;
         fd = open(filename, O_RDWR);
+        if (fd == -1) fd = open(filename, O_RDONLY);  // Logs and archives are often not ours to write
+        if (fd != -1 && !follow) compressed_open();
+        if (fd != -1 && !follow && !compressed && (fcntl(fd, F_GETFL) & O_ACCMODE) == O_RDONLY) {
+            close(fd);
+            fd = -1;
+            errno = EACCES;
+        }
     } else {
         fd = open(filename, O_RDWR | O_CREAT, 0644);
         file_size = 0;
     }
-    if (fd == -1) {
+    if (fd == -1 && !streaming) {
         perror("Failed to open file");
         return 1;
     }
 
     enable_raw_mode();
     atexit(disable_raw_mode);
-    signal(SIGWINCH, handle_resize);
+    event_init();
     get_window_size(&rows, &cols);
+    screen_resize(rows, cols);
+    show_stats = getenv("TV_STATS") && atoi(getenv("TV_STATS"));
 
     load_file();
+    if (follow) follow_watch();
+    if (inflating) gzip_start(map_base, stream_grow);
+    if (seeking) seek_start();
 
-    printf("\x1b[?1049h");
+    printf("\x1b[?1049h\x1b[?2004h");
+    fflush(stdout);
 
+    struct timespec frame = {0, 0};  // When the last frame was drawn
+    size_t drawn = 0;                // Rows of the view and version of the text it showed
+    unsigned long version = 0;
     while (1) {
-        if (resize_flag) {
-            get_window_size(&rows, &cols);
-            if (cursor_y >= (size_t)(rows - 2)) cursor_y = rows - 3;
-            if (scroll_y > buffer.count) scroll_y = buffer.count > 0 ? buffer.count - 1 : 0;
-            resize_flag = 0;
+        if (resize_flag) handle_resize();
+
+        // Keys that are already waiting, as when one is held down, are all
+        // taken in first, drawing at most once a frame while they come
+        struct timespec now;
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        if (!input_pending(0) || (now.tv_sec - frame.tv_sec) * 1000000000L + now.tv_nsec - frame.tv_nsec >= FRAME_NS) {
+            // Taken before drawing, so rows that arrive meanwhile still count as new
+            drawn = view_lines();
+            version = text_version;
+            draw_header();
             draw_text();
+            draw_footer();
+            screen_flush();
+            frame = now;
         }
 
-        draw_header();
-        draw_text();
-        draw_footer();
+        // Sleep until a key comes. A resize is drawn right away, and while
+        // the rest of the file is indexed, filtered, followed or read in,
+        // the progress moves every PROGRESS_MS and the screen fills up
+        // with what arrives; with none of that going on there is no timeout.
+        size_t line, col;
+        int wrapped;
+        while (input_start == input_end) {
+            if (resize_flag) {
+                // Seen here or by any wait before, such as the one above
+                handle_resize();
+                draw_header();
+                draw_text();
+                draw_footer();
+                screen_flush();
+            }
+            int busy = !index_done() || (filtering && search_poll(&line, &col, &wrapped) == SEARCH_RUNNING) ||
+                       follow || stream_fd != -1 || inflating;
+            int fds[2] = {follow_fd, stream_fd};
+            int events = event_wait(busy ? PROGRESS_MS : -1, fds, 2);
+            if (events & EVENT_RESIZE) resize_flag = 1;
+            if (events & EVENT_KEY) break;
+            if (resize_flag) continue;
+            if (!busy && !(events & EVENT_WORK)) continue;
+            if (index_stale()) follow_reload();  // The cached index was of another version of the file
+            if (follow) follow_update();
+            if (stream_fd != -1) stream_update();
+            if (inflating) gzip_update();
+            if (seeking == 1) seek_update();
+            filter_more();  // Text that came while the last round ran
+            if (follow_pinned) follow_end();
+            // Redrawn when the end of the text was on screen and has moved
+            size_t count = view_lines();
+            if ((count != drawn || version != text_version) && drawn <= (size_t)(scroll_y + rows - 2)) draw_text();
+            drawn = count;
+            version = text_version;
+            // The footer too, for what the work says when it stops
+            draw_header();
+            draw_footer();
+            screen_flush();
+        }
 
         int c = get_input();
+        status[0] = 0;
+        // Typing and deleting run on in one step of undo until something else comes
+        if (!(c >= 32 && c <= 126) && c != KEY_TAB && c != KEY_BACKSPACE && c != KEY_DELETE) undo_seal();
         if (c == KEY_F1) {
             // Help (placeholder)
         } else if (c == KEY_F3) {
@@ -554,6 +2220,8 @@ int main(int argc, char *argv[]) {
         } else if (c == KEY_F4) {
             if (!view_mode) {
                 if (!modified || handle_menu()) break;
+            } else if (streaming) {
+                snprintf(status, sizeof(status), compressed ? "Compressed files are read only" : "Standard input is read only");
             } else {
                 view_mode = 0;
                 draw_header();
@@ -566,95 +2234,113 @@ int main(int argc, char *argv[]) {
         } else if (c == KEY_UP) {
             if (cursor_y > 0) {
                 cursor_y--;
-                size_t disp_x = byte_to_display(buffer.lines[cursor_y].data, cursor_x, buffer.lines[cursor_y].len);
-                if (disp_x > utf8_display_length(buffer.lines[cursor_y].data, buffer.lines[cursor_y].len)) {
-                    cursor_x = buffer.lines[cursor_y].len;
-                }
-                if (cursor_y < (size_t)scroll_y) {
-                    scroll_y--;
-                    draw_text();
+                Line *l = view_line(cursor_y);
+                size_t disp_x = line_to_display(l, cursor_x);
+                if (disp_x > line_width(l)) {
+                    cursor_x = l->len;
                 }
+                if (cursor_y < (size_t)scroll_y) scroll_y--;
             }
         } else if (c == KEY_DOWN) {
-            if (cursor_y + 1 < buffer.count) {
+            if (view_line(cursor_y + 1)) {
                 cursor_y++;
-                size_t disp_x = byte_to_display(buffer.lines[cursor_y].data, cursor_x, buffer.lines[cursor_y].len);
-                if (disp_x > utf8_display_length(buffer.lines[cursor_y].data, buffer.lines[cursor_y].len)) {
-                    cursor_x = buffer.lines[cursor_y].len;
-                }
-                if (cursor_y >= (size_t)(scroll_y + rows - 2)) {
-                    scroll_y++;
-                    if (scroll_y + rows - 2 > buffer.count) {
-                        scroll_y = buffer.count > (size_t)(rows - 2) ? buffer.count - (rows - 2) : 0;
-                    }
-                    draw_text();
+                Line *l = view_line(cursor_y);
+                size_t disp_x = line_to_display(l, cursor_x);
+                if (disp_x > line_width(l)) {
+                    cursor_x = l->len;
                 }
+                if (cursor_y >= (size_t)(scroll_y + rows - 2)) scroll_y++;
             }
         } else if (c == KEY_LEFT) {
             if (cursor_x > 0) {
                 size_t i = cursor_x;
                 do {
                     i--;
-                } while (i > 0 && (buffer.lines[cursor_y].data[i] & 0xC0) == 0x80);
+                } while (i > 0 && (view_line(cursor_y)->data[i] & 0xC0) == 0x80);
                 cursor_x = i;
-                size_t disp_x = byte_to_display(buffer.lines[cursor_y].data, cursor_x, buffer.lines[cursor_y].len);
-                if (disp_x < scroll_x) {
-                    scroll_x--;
-                    draw_text();
-                }
+                size_t disp_x = line_to_display(view_line(cursor_y), cursor_x);
+                if (disp_x < scroll_x) scroll_x--;
             }
         } else if (c == KEY_RIGHT) {
-            Line *l = &buffer.lines[cursor_y];
-            if (cursor_x < l->len) {
+            Line *l = view_line(cursor_y);
+            if (l && cursor_x < l->len) {
                 cursor_x += utf8_char_bytes(l->data, cursor_x, l->len);
-                size_t disp_x = byte_to_display(l->data, cursor_x, l->len);
-                if (disp_x >= scroll_x + cols) {
-                    scroll_x++;
-                    draw_text();
-                }
+                size_t disp_x = line_to_display(l, cursor_x);
+                if (disp_x >= scroll_x + cols) scroll_x++;
             }
-        } else if (c == KEY_CTRL_LEFT && !view_mode) {
+        } else if (c == KEY_CTRL_HOME) {
+            cursor_x = cursor_y = 0;
+            scroll_x = scroll_y = 0;
+        } else if (c == KEY_CTRL_END) {
+            if (!filtering) index_wait((size_t)-1);  // The last line is known once indexing is done
+            size_t count = view_lines();
+            cursor_y = count ? count - 1 : 0;
+            cursor_x = 0;
+            scroll_x = 0;
+            scroll_y = count > (size_t)(rows - 2) ? count - (rows - 2) : 0;
+        } else if (c == KEY_F6) {
+            filter_prompt();
+            draw_footer();
+        } else if (filtering && (c == KEY_CTRL_F || c == KEY_CTRL_R || c == KEY_F7 ||
+                                 c == KEY_CTRL_N || c == KEY_CTRL_P)) {
+            // Searching would throw the filtered lines away
+            snprintf(status, sizeof(status), "Filtering, F6 and Enter shows all lines");
+        } else if (c == KEY_CTRL_F || c == KEY_CTRL_R) {
+            find_prompt(c == KEY_CTRL_R);
+        } else if (c == KEY_F7) {
+            regex_prompt();
+            draw_footer();
+        } else if (c == KEY_CTRL_N || c == KEY_CTRL_P) {
+            if (search_regex) find_regex_next(c == KEY_CTRL_P, 0);
+            else if (search_text[0]) find_next(c == KEY_CTRL_P);
+            else find_prompt(c == KEY_CTRL_P);
+        } else if (c == KEY_CTRL_G) {
+            char line[32];
+            if (prompt("Go to line:", line, sizeof(line))) goto_line(strtoull(line, NULL, 10));
+            draw_footer();
+        } else if (c == KEY_CTRL_LEFT && !view_mode && !filtering) {
             move_cursor_word(-1);
-        } else if (c == KEY_CTRL_RIGHT && !view_mode) {
+        } else if (c == KEY_CTRL_RIGHT && !view_mode && !filtering) {
             move_cursor_word(1);
         } else if (c == KEY_PGUP) {
             if (scroll_y > 0) {
                 scroll_y -= rows - 2;
-                cursor_y -= rows - 2;
+                cursor_y = cursor_y > (size_t)(rows - 2) ? cursor_y - (rows - 2) : 0;
                 if (scroll_y < 0) scroll_y = 0;
-                if (cursor_y < 0) cursor_y = 0;
-                size_t disp_x = byte_to_display(buffer.lines[cursor_y].data, cursor_x, buffer.lines[cursor_y].len);
-                if (disp_x > utf8_display_length(buffer.lines[cursor_y].data, buffer.lines[cursor_y].len)) {
-                    cursor_x = buffer.lines[cursor_y].len;
+                Line *l = view_line(cursor_y);
+                size_t disp_x = line_to_display(l, cursor_x);
+                if (disp_x > line_width(l)) {
+                    cursor_x = l->len;
                 }
-                draw_text();
             }
         } else if (c == KEY_PGDOWN) {
-            if (scroll_y + rows - 2 < (int)buffer.count) {
+            // Only waits when the next page is past what the index has found
+            // so far, the filter shows what it has found
+            view_line(scroll_y + 2 * (rows - 2) - 1);
+            size_t count = view_lines();
+            if (scroll_y + rows - 2 < (int)count) {
                 scroll_y += rows - 2;
                 cursor_y += rows - 2;
-                if (cursor_y >= buffer.count) cursor_y = buffer.count - 1;
-                if (scroll_y + rows - 2 > buffer.count) {
-                    scroll_y = buffer.count > (size_t)(rows - 2) ? buffer.count - (rows - 2) : 0;
+                if (cursor_y >= count) cursor_y = count - 1;
+                if (scroll_y + rows - 2 > count) {
+                    scroll_y = count > (size_t)(rows - 2) ? count - (rows - 2) : 0;
                 }
-                size_t disp_x = byte_to_display(buffer.lines[cursor_y].data, cursor_x, buffer.lines[cursor_y].len);
-                if (disp_x > utf8_display_length(buffer.lines[cursor_y].data, buffer.lines[cursor_y].len)) {
-                    cursor_x = buffer.lines[cursor_y].len;
+                Line *l = view_line(cursor_y);
+                size_t disp_x = line_to_display(l, cursor_x);
+                if (disp_x > line_width(l)) {
+                    cursor_x = l->len;
                 }
-                draw_text();
             }
         } else if (c == KEY_HOME) {
             cursor_x = 0;
             scroll_x = 0;
-            draw_text();
-        } else if (c == KEY_END) {
-            Line *l = &buffer.lines[cursor_y];
+        } else if (c == KEY_END && view_line(cursor_y)) {
+            Line *l = view_line(cursor_y);
             cursor_x = l->len;
-            size_t disp_x = byte_to_display(l->data, cursor_x, l->len);
+            size_t disp_x = line_to_display(l, cursor_x);
             if (disp_x >= (size_t)cols) scroll_x = disp_x - cols + 1;
             else scroll_x = 0;
-            draw_text();
-        } else if (!view_mode) {
+        } else if (!view_mode && !filtering) {
             if (c == KEY_INSERT) {
                 insert_mode = !insert_mode;
                 draw_header();
@@ -663,14 +2349,14 @@ int main(int argc, char *argv[]) {
                     size_t i = cursor_x;
                     do {
                         i--;
-                    } while (i > 0 && (buffer.lines[cursor_y].data[i] & 0xC0) == 0x80);
+                    } while (i > 0 && (get_line(cursor_y)->data[i] & 0xC0) == 0x80);
                     cursor_x = i;
                     delete_char();
                 } else if (cursor_y > 0) {
-                    Line *prev = &buffer.lines[cursor_y - 1];
-                    cursor_x = prev->len;
-                    delete_char();
                     cursor_y--;
+                    cursor_x = get_line(cursor_y)->len;
+                    if (cursor_y < (size_t)scroll_y) scroll_y = cursor_y;
+                    delete_char();
                 }
             } else if (c == KEY_DELETE) {
                 delete_char();
@@ -680,14 +2366,33 @@ int main(int argc, char *argv[]) {
                 insert_char(c);
             } else if (c == KEY_ENTER) {
                 insert_char('\n');
+            } else if (c == KEY_PASTE) {
+                insert_text(paste_buf, paste_len);
+            } else if (c == KEY_CTRL_U || c == KEY_CTRL_Y) {
+                UndoEdit *e = c == KEY_CTRL_U ? undo_back() : undo_forward();
+                if (e) undo_apply(e, c == KEY_CTRL_Y);
+                else snprintf(status, sizeof(status), c == KEY_CTRL_U ? "Nothing to undo" : "Nothing to redo");
             }
         }
+        // Scrolled back from the end or onto it again
+        if (follow || stream_fd != -1 || inflating) follow_pinned = (size_t)(scroll_y + rows - 2) >= line_count();
     }
 
-    if (modified) save_file();
+    int failed = modified && save_file() == -1;
+    search_free();  // A filter round may still be reading the mapping
+    if (!seeking) gzip_free();
     close(fd);
     free_buffer();
-    printf("\x1b[?1049l\x1b[2J\x1b[H");
-    return 0;
+    // Threads reading the text may have waited on seek.c until now
+    seek_close();
+    if (seeking) gzip_free();
+    if (search_regex) regfree(&search_re);
+    pool_free();
+    screen_free();
+    free(paste_buf);
+    undo_free();
+    printf("\x1b[?2004l\x1b[?1049l\x1b[2J\x1b[H");
+    if (failed) fprintf(stderr, "tv: %s\n", status);
+    return failed;
 
 }
@@ -6,12 +6,18 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <stdint.h>
+#include <stddef.h>
 #include <string.h>
 #include <sys/stat.h>
 #include <fcntl.h>
 #include <unistd.h>
 #include <termios.h>
 #include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/uio.h>
+#include <limits.h>
+#include <time.h>
+#include <poll.h>
 #include <signal.h>
 #include <errno.h>
 #include <ctype.h>
@@ -20,10 +26,135 @@ size_t utf8_char_bytes(const char *data, size_t pos, size_t len);
 size_t find_last_utf8_boundary(const char *buf, size_t len);
 uint32_t utf8_to_codepoint(const char *data, size_t pos, size_t len, size_t *bytes);
 int utf8_char_width(uint32_t cp);
+size_t utf8_ascii_prefix(const char *data, size_t len);
 size_t utf8_display_length(const char *data, size_t len);
 size_t byte_to_display(const char *data, size_t byte_pos, size_t len);
 size_t display_to_byte(const char *data, size_t disp_pos, size_t len);
 uint32_t get_utf8_char_at(const char *data, size_t byte_pos, size_t len, size_t *bytes, int *width);
 void print_utf8_char(uint32_t cp);
 
+// Line index
+extern size_t (*scan_newlines)(const char *data, size_t len, uint64_t base,
+                               uint64_t *out, size_t max, size_t *scanned);
+
+void index_init();
+void index_start(const char *filename, int derived, const char *data, size_t size, size_t lines);
+void index_grow(const char *data, size_t size);
+void index_rebuild(const char *data, size_t size);
+void index_append(uint64_t offset);
+void index_append_lines(size_t line, size_t newlines, int64_t shift);
+void index_rebuild_done();
+void index_save_cache();
+void index_drop_cache();
+void index_stop();
+int index_done();
+int index_stale();
+int index_progress();
+size_t index_lines();
+size_t index_wait(size_t lines);
+uint64_t index_line_start(size_t i);
+void index_free();
+int cache_path(const char *filename, const char *ext, char *out, size_t size);
+void cache_mkdir(const char *path);
+
+// Screen
+void screen_resize(int rows, int cols);
+void screen_invalidate();
+void screen_fill(int row, int col, int n, const char *style);
+int screen_text(int row, int col, const char *text, size_t len, int max, const char *style);
+int screen_printf(int row, int col, const char *style, const char *fmt, ...);
+void screen_cursor(int row, int col);
+void screen_flush();
+void screen_stats(size_t *bytes, int *writes);
+void screen_free();
+
+// Search
+#define SEARCH_UNKNOWN ((size_t)-1)
+#define SEARCH_RUNNING 0
+#define SEARCH_FOUND 1
+#define SEARCH_MISSING 2
+#define SEARCH_CANCELLED 3
+
+typedef struct {
+    const char *data;   // Whole lines of the text
+    size_t len;
+    size_t line;        // Line the run starts on
+    size_t newlines;    // Newlines in the run, SEARCH_UNKNOWN if not known
+} SearchRun;
+
+typedef struct {
+    size_t line, col;
+    const char *data;   // The line, borrowed from the text the search ran on
+    size_t len;
+} SearchHit;
+
+const char *search_find(const char *data, size_t len, const char *needle, size_t n);
+const char *search_find_last(const char *data, size_t len, const char *needle, size_t n);
+size_t count_newlines(const char *data, size_t len);
+void search_start(SearchRun *runs, size_t count, size_t run, size_t offset,
+                  const char *needle, size_t n, int backward);
+void search_start_regex(SearchRun *runs, size_t count, const char *pattern);
+void search_more_regex(SearchRun *runs, size_t count, size_t from);
+size_t search_end_line();
+size_t search_hit_count();
+SearchHit *search_hit(size_t i);
+void search_cancel();
+int search_poll(size_t *line, size_t *col, int *wrapped);
+int search_progress();
+void search_free();
+
+// Events
+#define EVENT_KEY 1     // The terminal has input
+#define EVENT_RESIZE 2  // The terminal has a new size
+#define EVENT_WORK 4    // A thread has posted that something is done
+#define EVENT_FD 8      // One of the descriptors waited on is readable
+
+void event_init();
+void event_post();
+int event_wait(int ms, const int *fds, int count);
+
+// Undo
+typedef struct {
+    size_t y, x;               // Where the edit starts
+    size_t removed, inserted;  // Bytes of text it took out and put in, which follow
+} UndoEdit;
+
+void undo_record(size_t y, size_t x, const char *removed, size_t rlen, const char *inserted, size_t ilen);
+void undo_seal();
+UndoEdit *undo_back();
+UndoEdit *undo_forward();
+void undo_free();
+
+// Arena
+void *arena_alloc(size_t size, size_t *capacity);
+void arena_release(void *p, size_t size);
+void *arena_resize(void *p, size_t capacity, size_t size, size_t *new_capacity);
+void arena_stats(size_t *blocks, size_t *used, size_t *reserved);
+void arena_free();
+
+// gzip
+int gzip_detect(const char *data, size_t len);
+size_t gzip_index(const char *filename, const char *in, size_t len);
+int gzip_seek(char *text);
+void gzip_start(char *out, int (*grow)(size_t need));
+size_t gzip_size();
+int gzip_state(size_t *at);
+void gzip_free();
+
+// Seeking in compressed text
+int spill_open();
+int seek_open(char *text, size_t size, const uint64_t *points, size_t count,
+              int (*fill)(size_t unit, char *out, size_t from, size_t to, size_t *error_at),
+              int (*check)(size_t *error_at));
+void seek_start();
+void seek_need(const char *at, size_t len);
+const char *seek_newline(const char *at, size_t len);
+int seek_state(size_t *at);
+void seek_close();
+
+// Thread pool
+int pool_threads();
+void pool_run(size_t count, void (*fn)(size_t task, void *arg), void *arg);
+void pool_free();
+
 #endif
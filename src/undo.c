@@ -0,0 +1,152 @@
+// undo.c the journal behind undo and redo: an append-only log of records,
+// each an edit's place with the text it took out and the text it put in.
+// Undo walks back through the log and redo forward again. Typing or
+// deleting along a line grows the record before it, and the oldest
+// records go once the log outgrows UNDO_MEMORY.
+
+#include "tv.h"
+
+#define UNDO_MEMORY (32 << 20)
+#define UNDO_RUN 256  // Bytes a run of typing or deleting grows to in one record
+
+typedef struct {
+    char *log;        // Records, each followed by its text and its own size
+    size_t end;       // Bytes of the log in use
+    size_t pos;       // Records before it are undone by undo_back(), those after redone
+    size_t capacity;
+    int sealed;       // The next edit starts a record of its own
+} Journal;
+
+static Journal journal;
+
+static size_t record_size(const UndoEdit *e) {
+    return sizeof(UndoEdit) + ((e->removed + e->inserted + 7) & ~(size_t)7) + sizeof(size_t);
+}
+
+static void record_close(size_t at, size_t size) {
+    *(size_t *)(journal.log + at + size - sizeof(size_t)) = size;
+    journal.end = journal.pos = at + size;
+}
+
+// Room for need bytes of log, 0 when that is more than UNDO_MEMORY
+static int journal_room(size_t need) {
+    Journal *j = &journal;
+    if (need <= j->capacity) return 1;
+    if (need > UNDO_MEMORY) return 0;
+    size_t capacity = j->capacity ? j->capacity : 4096;
+    while (capacity < need) capacity *= 2;
+    if (capacity > UNDO_MEMORY) capacity = UNDO_MEMORY;
+    char *log = realloc(j->log, capacity);
+    if (!log) return 0;
+    j->log = log;
+    j->capacity = capacity;
+    return 1;
+}
+
+// Drop the oldest records when size more bytes would not fit. Down to half
+// of UNDO_MEMORY, so each move is paid for by the records that filled it.
+static void journal_trim(size_t size) {
+    Journal *j = &journal;
+    if (j->end + size <= UNDO_MEMORY) return;
+    size_t drop = 0;
+    while (drop < j->end && j->end - drop + size > UNDO_MEMORY / 2) drop += record_size((UndoEdit *)(j->log + drop));
+    memmove(j->log, j->log + drop, j->end - drop);
+    j->end -= drop;
+    j->pos = j->end;
+}
+
+static int is_blank(char c) {
+    return c == ' ' || c == '\t';
+}
+
+// Fold the edit into the last record when it carries on from it along
+// the same line: typing up to the start of a new word, overwriting, or
+// deleting forward or backward
+static int journal_merge(size_t y, size_t x, const char *removed, size_t rlen, const char *inserted, size_t ilen) {
+    Journal *j = &journal;
+    size_t at = j->end - *(size_t *)(j->log + j->end - sizeof(size_t));
+    UndoEdit *e = (UndoEdit *)(j->log + at);
+    char *text = (char *)(e + 1);
+    if (e->y != y || e->removed + e->inserted + rlen + ilen > UNDO_RUN) return 0;
+    if (memchr(text, '\n', e->removed + e->inserted) || (rlen && memchr(removed, '\n', rlen)) ||
+        (ilen && memchr(inserted, '\n', ilen))) return 0;
+    int typing = e->removed == 0 && rlen == 0 && ilen && x == e->x + e->inserted &&
+                 !(e->inserted && is_blank(text[e->inserted - 1]) && !is_blank(inserted[0]));
+    int overwrite = e->removed && e->inserted && rlen && ilen && x == e->x + e->inserted;
+    int forward = e->inserted == 0 && ilen == 0 && x == e->x;
+    int backward = e->inserted == 0 && ilen == 0 && rlen && x + rlen == e->x;
+    if (!typing && !overwrite && !forward && !backward) return 0;
+
+    UndoEdit grown = *e;
+    grown.removed += rlen;
+    grown.inserted += ilen;
+    size_t size = record_size(&grown);
+    if (!journal_room(at + size)) return 0;
+    e = (UndoEdit *)(j->log + at);
+    text = (char *)(e + 1);
+    memmove(text + grown.removed, text + e->removed, e->inserted);
+    if (backward) {
+        memmove(text + rlen, text, e->removed);
+        memcpy(text, removed, rlen);
+        grown.x = x;
+    } else if (rlen) {
+        memcpy(text + e->removed, removed, rlen);
+    }
+    if (ilen) memcpy(text + grown.removed + e->inserted, inserted, ilen);
+    *e = grown;
+    record_close(at, size);
+    return 1;
+}
+
+// Note an edit: at byte x of line y, rlen bytes of removed went and ilen
+// bytes of inserted came in their place. Anything undone before can no
+// longer be redone. An edit too big for the journal is not kept, nor is
+// anything before it, as that would no longer lead to the text.
+void undo_record(size_t y, size_t x, const char *removed, size_t rlen, const char *inserted, size_t ilen) {
+    Journal *j = &journal;
+    j->end = j->pos;
+    if (!j->sealed && j->end > 0 && journal_merge(y, x, removed, rlen, inserted, ilen)) return;
+    j->sealed = 0;
+    UndoEdit e = {y, x, rlen, ilen};
+    size_t size = record_size(&e);
+    journal_trim(size);
+    if (!journal_room(j->end + size)) {
+        j->end = j->pos = 0;
+        return;
+    }
+    char *p = j->log + j->end;
+    memcpy(p, &e, sizeof(e));
+    if (rlen) memcpy(p + sizeof(e), removed, rlen);
+    if (ilen) memcpy(p + sizeof(e) + rlen, inserted, ilen);
+    record_close(j->end, size);
+}
+
+// The next edit is a step of its own, as after the cursor moved away
+void undo_seal() {
+    journal.sealed = 1;
+}
+
+// The edit to take back, NULL when there is none. The record and its
+// text after it stay valid until the next undo_record().
+UndoEdit *undo_back() {
+    Journal *j = &journal;
+    if (j->pos == 0) return NULL;
+    j->pos -= *(size_t *)(j->log + j->pos - sizeof(size_t));
+    j->sealed = 1;
+    return (UndoEdit *)(j->log + j->pos);
+}
+
+// The edit to make again, NULL when there is none
+UndoEdit *undo_forward() {
+    Journal *j = &journal;
+    if (j->pos == j->end) return NULL;
+    UndoEdit *e = (UndoEdit *)(j->log + j->pos);
+    j->pos += record_size(e);
+    j->sealed = 1;
+    return e;
+}
+
+void undo_free() {
+    free(journal.log);
+    memset(&journal, 0, sizeof(journal));
+}
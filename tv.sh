@@ -2,7 +2,7 @@
 
 echo "Compiling..."
 
-gcc src/tv.c src/utf8.c -o tv
+gcc -O2 -pthread src/tv.c src/utf8.c src/index.c src/pool.c src/screen.c src/search.c src/gzip.c src/seek.c src/arena.c src/event.c src/undo.c -o tv
 
 if [ $? -eq 0 ]; then
   echo "OK"
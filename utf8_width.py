@@ -0,0 +1,108 @@
+#!/usr/bin/env python3
+# utf8_width.py generates src/utf8_width.h, the two-stage table behind
+# utf8_char_width(). Widths come from EastAsianWidth.txt and the general
+# category in UnicodeData.txt when both are given, otherwise from Python's
+# unicodedata:
+#
+#   ./utf8_width.py [EastAsianWidth.txt UnicodeData.txt] > src/utf8_width.h
+#
+# 0 for combining marks, format characters and Hangul medial/final jamo,
+# 2 for Wide and Fullwidth, 1 for everything else. Control characters stay
+# at 1, the screen shows them as one cell.
+
+import sys
+import unicodedata
+
+MAX = 0x110000
+BLOCK = 256
+
+# Unassigned code points in these ranges default to Wide
+WIDE_DEFAULT = [(0x3400, 0x4DBF), (0x4E00, 0x9FFF), (0xF900, 0xFAFF),
+                (0x20000, 0x2FFFD), (0x30000, 0x3FFFD)]
+
+
+def ranges(path):
+    for line in open(path, encoding='utf-8'):
+        line = line.split('#')[0].strip()
+        if not line:
+            continue
+        fields = [f.strip() for f in line.split(';')]
+        if '..' in fields[0]:
+            lo, hi = fields[0].split('..')
+        else:
+            lo = hi = fields[0]
+        yield int(lo, 16), int(hi, 16), fields[1:]
+
+
+def from_files(eaw_path, data_path):
+    eaw = ['N'] * MAX
+    cat = ['Cn'] * MAX
+    for lo, hi, f in ranges(eaw_path):
+        eaw[lo:hi + 1] = [f[0]] * (hi - lo + 1)
+    first = None
+    for cp, _, f in ranges(data_path):
+        if f[0].endswith(', First>'):
+            first = cp
+            continue
+        if f[0].endswith(', Last>'):
+            cat[first:cp + 1] = [f[1]] * (cp - first + 1)
+        else:
+            cat[cp] = f[1]
+    return lambda cp: eaw[cp], lambda cp: cat[cp]
+
+
+def width(cp, eaw, cat):
+    c = cat(cp)
+    if cp == 0x00AD:
+        return 1  # Soft hyphen is shown
+    if c in ('Mn', 'Me', 'Cf') or 0x1160 <= cp <= 0x11FF or cp == 0x200B:
+        return 0
+    if eaw(cp) in ('W', 'F'):
+        return 2
+    if c == 'Cn' and any(lo <= cp <= hi for lo, hi in WIDE_DEFAULT):
+        return 2
+    return 1
+
+
+def main():
+    if len(sys.argv) == 3:
+        eaw, cat = from_files(sys.argv[1], sys.argv[2])
+        source = 'EastAsianWidth.txt, UnicodeData.txt'
+    else:
+        cat = lambda cp: unicodedata.category(chr(cp))
+        # unicodedata reports unassigned code points as Fullwidth
+        eaw = lambda cp: 'N' if cat(cp) == 'Cn' else unicodedata.east_asian_width(chr(cp))
+        source = 'Unicode %s (Python unicodedata)' % unicodedata.unidata_version
+
+    blocks, stage1, stage2 = {}, [], []
+    for base in range(0, MAX, BLOCK):
+        packed = bytearray(BLOCK // 4)
+        for i in range(BLOCK):
+            packed[i >> 2] |= width(base + i, eaw, cat) << ((i & 3) * 2)
+        key = bytes(packed)
+        if key not in blocks:
+            blocks[key] = len(stage2)
+            stage2.append(key)
+        stage1.append(blocks[key])
+    assert len(stage2) <= 256
+
+    out = sys.stdout
+    out.write('// utf8_width.h generated by utf8_width.py from %s, do not edit\n\n' % source)
+    out.write('#define UTF8_WIDTH_BLOCK %d\n\n' % BLOCK)
+    out.write('// Block of 256 code points -> index into utf8_width_blocks\n')
+    out.write('static const uint8_t utf8_width_index[%d] = {\n' % len(stage1))
+    for i in range(0, len(stage1), 16):
+        out.write('    ' + ', '.join('%d' % b for b in stage1[i:i + 16]) + ',\n')
+    out.write('};\n\n')
+    out.write('// Widths of 256 code points, 2 bits each, lowest bits first\n')
+    out.write('static const uint8_t utf8_width_blocks[%d][%d] = {\n' % (len(stage2), BLOCK // 4))
+    for block in stage2:
+        out.write('    {\n')
+        for i in range(0, len(block), 16):
+            out.write('        ' + ', '.join('0x%02x' % b for b in block[i:i + 16]) + ',\n')
+        out.write('    },\n')
+    out.write('};\n')
+
+
+if __name__ == '__main__':
+    main()